@@ -0,0 +1,340 @@
+/* Benchmarks of dss. Every benchmark runs in a child process so that its
+ * peak RSS is its own, and prints one JSON object per line:
+ *
+ *   {"name": ..., "impl": "dss", "ops": ..., "ns_per_op": ...,
+ *    "bytes_per_op": ..., "allocs": ..., "reallocs": ..., "peak_rss_kb": ...}
+ *
+ * Allocations are counted through dss_set_allocator. "bytes_per_op" is the
+ * number of bytes requested from the allocator divided by the number of
+ * operations. Strings over the mmap threshold are resized with mremap, which
+ * is not counted there.
+ *
+ * Usage: bench [-s scale] [-r] [-t blocks] [name...]
+ *   -s  multiplies the number of operations of every benchmark
+ *   -t  turns on the thread cache with this many blocks per size class
+ *   -r  runs the two README experiments at their original size
+ *       (1B x 5 bytes and 5 x 1 GB), which takes minutes and 10 GB of RAM
+ *   name  only runs the benchmarks with these names
+ *
+ * Building with -DBENCH_SDS and linking sds.c adds the same workloads on
+ * top of sds, see the Makefile. */
+#define _GNU_SOURCE
+#include "../dss.h"
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef BENCH_SDS
+#include "sds.h"
+#endif
+
+static size_t n_allocs, n_reallocs, n_bytes;
+
+static void *count_malloc(size_t n) {
+  n_allocs++;
+  n_bytes += n;
+  return malloc(n);
+}
+
+static void *count_realloc(void *p, size_t n) {
+  n_reallocs++;
+  n_bytes += n;
+  return realloc(p, n);
+}
+
+static const dss_allocator counting = {count_malloc, count_realloc, free,
+                                       malloc_usable_size};
+
+/* Keeps the compiler from dropping the work of a benchmark */
+static volatile size_t sink;
+
+static double scale = 1;
+static int readme;
+
+static size_t ops(double n) {
+  size_t r = (size_t)(n * scale);
+  return r ? r : 1;
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Benchmarks return the number of operations they timed and add the time
+ * they took to 'ns', leaving setup out of it. */
+typedef size_t (*bench_fn)(double *ns);
+
+/* README experiment 1: 5 bytes appended over and over */
+static size_t concat_small(double *ns) {
+  size_t n = readme ? 1000000000 : ops(1e7);
+  dss s = dss_empty();
+  double t = now_ns();
+  for (size_t i = 0; i < n; i++)
+    s = dss_concatb(s, "\x01\x02\x03\x04\x05", 5);
+  *ns += now_ns() - t;
+  sink += dss_len(s);
+  dss_free(s);
+  return n;
+}
+
+/* README experiment 2: a few very large appends */
+static size_t concat_large(double *ns) {
+  size_t chunk = readme ? (size_t)1 << 30 : ops(1 << 26);
+  char *buf = malloc(chunk);
+  if (!buf)
+    return 0;
+  memset(buf, 'x', chunk);
+  dss s = dss_empty();
+  double t = now_ns();
+  for (int i = 0; i < 5; i++)
+    s = dss_concatb(s, buf, chunk);
+  *ns += now_ns() - t;
+  sink += dss_len(s);
+  dss_free(s);
+  free(buf);
+  return 5;
+}
+
+static size_t create_free(double *ns) {
+  size_t n = ops(1e7);
+  double t = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    dss s = dss_new("region=eu-west-1");
+    sink += s[i & 7];
+    dss_free(s);
+  }
+  *ns += now_ns() - t;
+  return n;
+}
+
+static size_t catprintf(double *ns) {
+  size_t n = ops(1e6);
+  dss s = dss_empty();
+  double t = now_ns();
+  for (size_t i = 0; i < n; i++)
+    s = dss_catprintf(s, dss_concat, "%zu:%s,", i, "v");
+  *ns += now_ns() - t;
+  sink += dss_len(s);
+  dss_free(s);
+  return n;
+}
+
+/* Appending to a string that has another reference copies it every time */
+static size_t cow_append(double *ns) {
+  size_t n = ops(1e6);
+  dss base = dss_new("GET /index.html HTTP/1.1\r\nHost: example.com\r\n");
+  double t = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    dss s = dss_concatcow(dss_refshare(base), "Accept: */*\r\n\r\n");
+    sink += dss_len(s);
+    dss_free(s);
+  }
+  *ns += now_ns() - t;
+  dss_free(base);
+  return n;
+}
+
+static size_t trim(double *ns) {
+  size_t n = ops(1e6);
+  char line[128];
+  memset(line, ' ', sizeof(line));
+  memcpy(line + 8, "payload", 7);
+  double t = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    dss s = dss_newb(line, sizeof(line));
+    s = dss_trim(s, 8, 14);
+    sink += dss_len(s);
+    dss_free(s);
+  }
+  *ns += now_ns() - t;
+  return n;
+}
+
+static size_t refshare(double *ns) {
+  size_t n = ops(1e8);
+  dss s = dss_new("shared");
+  double t = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    dss r = dss_refshare(s);
+    dss_free(r);
+  }
+  *ns += now_ns() - t;
+  dss_free(s);
+  return n;
+}
+
+#ifdef BENCH_SDS
+static size_t sds_concat_small(double *ns) {
+  size_t n = readme ? 1000000000 : ops(1e7);
+  sds s = sdsempty();
+  double t = now_ns();
+  for (size_t i = 0; i < n; i++)
+    s = sdscatlen(s, "\x01\x02\x03\x04\x05", 5);
+  *ns += now_ns() - t;
+  sink += sdslen(s);
+  sdsfree(s);
+  return n;
+}
+
+static size_t sds_concat_large(double *ns) {
+  size_t chunk = readme ? (size_t)1 << 30 : ops(1 << 26);
+  char *buf = malloc(chunk);
+  if (!buf)
+    return 0;
+  memset(buf, 'x', chunk);
+  sds s = sdsempty();
+  double t = now_ns();
+  for (int i = 0; i < 5; i++)
+    s = sdscatlen(s, buf, chunk);
+  *ns += now_ns() - t;
+  sink += sdslen(s);
+  sdsfree(s);
+  free(buf);
+  return 5;
+}
+
+static size_t sds_create_free(double *ns) {
+  size_t n = ops(1e7);
+  double t = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    sds s = sdsnew("region=eu-west-1");
+    sink += s[i & 7];
+    sdsfree(s);
+  }
+  *ns += now_ns() - t;
+  return n;
+}
+
+static size_t sds_catprintf(double *ns) {
+  size_t n = ops(1e6);
+  sds s = sdsempty();
+  double t = now_ns();
+  for (size_t i = 0; i < n; i++)
+    s = sdscatprintf(s, "%zu:%s,", i, "v");
+  *ns += now_ns() - t;
+  sink += sdslen(s);
+  sdsfree(s);
+  return n;
+}
+
+static size_t sds_trim(double *ns) {
+  size_t n = ops(1e6);
+  char line[128];
+  memset(line, ' ', sizeof(line));
+  memcpy(line + 8, "payload", 7);
+  double t = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    sds s = sdsnewlen(line, sizeof(line));
+    sdsrange(s, 8, 14);
+    sink += sdslen(s);
+    sdsfree(s);
+  }
+  *ns += now_ns() - t;
+  return n;
+}
+#endif
+
+static const struct {
+  const char *name;
+  const char *impl;
+  bench_fn fn;
+} benches[] = {
+    {"concat_small", "dss", concat_small},
+    {"concat_large", "dss", concat_large},
+    {"create_free", "dss", create_free},
+    {"catprintf", "dss", catprintf},
+    {"cow_append", "dss", cow_append},
+    {"trim", "dss", trim},
+    {"refshare", "dss", refshare},
+#ifdef BENCH_SDS
+    {"concat_small", "sds", sds_concat_small},
+    {"concat_large", "sds", sds_concat_large},
+    {"create_free", "sds", sds_create_free},
+    {"catprintf", "sds", sds_catprintf},
+    {"trim", "sds", sds_trim},
+#endif
+};
+
+static void run(const char *name, const char *impl, bench_fn fn) {
+  double ns = 0;
+  struct rusage ru;
+
+  n_allocs = n_reallocs = n_bytes = 0;
+  size_t n = fn(&ns);
+  getrusage(RUSAGE_SELF, &ru);
+  if (n == 0) {
+    fprintf(stderr, "%s: not able to allocate memory.\n", name);
+    exit(1);
+  }
+
+  /* sds does not go through the allocator of dss */
+  int counted = strcmp(impl, "dss") == 0;
+  printf("{\"name\": \"%s\", \"impl\": \"%s\", \"ops\": %zu, "
+         "\"ns_per_op\": %.3f, ",
+         name, impl, n, ns / n);
+  if (counted)
+    printf("\"bytes_per_op\": %.3f, \"allocs\": %zu, \"reallocs\": %zu, ",
+           (double)n_bytes / n, n_allocs, n_reallocs);
+  else
+    printf("\"bytes_per_op\": null, \"allocs\": null, \"reallocs\": null, ");
+  printf("\"peak_rss_kb\": %ld}\n", ru.ru_maxrss);
+  fflush(stdout);
+}
+
+static int selected(const char *name, char **names, int count) {
+  if (count == 0)
+    return 1;
+  for (int i = 0; i < count; i++)
+    if (strcmp(name, names[i]) == 0)
+      return 1;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "s:rt:")) != -1) {
+    switch (opt) {
+    case 's':
+      scale = atof(optarg);
+      break;
+    case 'r':
+      readme = 1;
+      break;
+    case 't':
+      dss_set_thread_cache(strtoul(optarg, NULL, 10));
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-s scale] [-r] [-t blocks] [name...]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+
+  dss_set_allocator(&counting);
+  fflush(stdout);
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+    if (!selected(benches[i].name, argv + optind, argc - optind))
+      continue;
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      return 1;
+    }
+    if (pid == 0) {
+      run(benches[i].name, benches[i].impl, benches[i].fn);
+      _exit(0);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0)
+      failed = 1;
+  }
+  return failed;
+}
@@ -0,0 +1,169 @@
+// The workloads of bench.c on top of std::string, printing the same JSON
+// lines with "impl": "std::string". Allocations are not counted.
+//
+// Usage: bench_std [-s scale] [-r] [name...], as for bench.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static volatile size_t sink;
+static double scale = 1;
+static int readme;
+
+static size_t ops(double n) {
+  size_t r = (size_t)(n * scale);
+  return r ? r : 1;
+}
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t concat_small(double *ns) {
+  size_t n = readme ? 1000000000 : ops(1e7);
+  std::string s;
+  double t = now_ns();
+  for (size_t i = 0; i < n; i++)
+    s.append("\x01\x02\x03\x04\x05", 5);
+  *ns += now_ns() - t;
+  sink += s.size();
+  return n;
+}
+
+static size_t concat_large(double *ns) {
+  size_t chunk = readme ? (size_t)1 << 30 : ops(1 << 26);
+  std::string buf(chunk, 'x');
+  std::string s;
+  double t = now_ns();
+  for (int i = 0; i < 5; i++)
+    s.append(buf);
+  *ns += now_ns() - t;
+  sink += s.size();
+  return 5;
+}
+
+static size_t create_free(double *ns) {
+  size_t n = ops(1e7);
+  double t = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    // Longer than the small string buffer, like most of the dss workload
+    std::string *s = new std::string("region=eu-west-1");
+    sink += (*s)[i & 7];
+    delete s;
+  }
+  *ns += now_ns() - t;
+  return n;
+}
+
+static size_t catprintf(double *ns) {
+  size_t n = ops(1e6);
+  std::string s;
+  char buf[64];
+  double t = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    int len = snprintf(buf, sizeof(buf), "%zu:%s,", i, "v");
+    s.append(buf, len);
+  }
+  *ns += now_ns() - t;
+  sink += s.size();
+  return n;
+}
+
+static size_t cow_append(double *ns) {
+  size_t n = ops(1e6);
+  std::string base("GET /index.html HTTP/1.1\r\nHost: example.com\r\n");
+  double t = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    std::string s = base + "Accept: */*\r\n\r\n";
+    sink += s.size();
+  }
+  *ns += now_ns() - t;
+  return n;
+}
+
+static size_t trim(double *ns) {
+  size_t n = ops(1e6);
+  char line[128];
+  memset(line, ' ', sizeof(line));
+  memcpy(line + 8, "payload", 7);
+  double t = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    std::string s(line, sizeof(line));
+    s = s.substr(8, 7);
+    s.shrink_to_fit();
+    sink += s.size();
+  }
+  *ns += now_ns() - t;
+  return n;
+}
+
+static const struct {
+  const char *name;
+  size_t (*fn)(double *);
+} benches[] = {
+    {"concat_small", concat_small}, {"concat_large", concat_large},
+    {"create_free", create_free},   {"catprintf", catprintf},
+    {"cow_append", cow_append},     {"trim", trim},
+};
+
+static int selected(const char *name, char **names, int count) {
+  if (count == 0)
+    return 1;
+  for (int i = 0; i < count; i++)
+    if (strcmp(name, names[i]) == 0)
+      return 1;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "s:r")) != -1) {
+    switch (opt) {
+    case 's':
+      scale = atof(optarg);
+      break;
+    case 'r':
+      readme = 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-s scale] [-r] [name...]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  fflush(stdout);
+  int failed = 0;
+  for (const auto &b : benches) {
+    if (!selected(b.name, argv + optind, argc - optind))
+      continue;
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      return 1;
+    }
+    if (pid == 0) {
+      double ns = 0;
+      struct rusage ru;
+      size_t n = b.fn(&ns);
+      getrusage(RUSAGE_SELF, &ru);
+      printf("{\"name\": \"%s\", \"impl\": \"std::string\", \"ops\": %zu, "
+             "\"ns_per_op\": %.3f, \"bytes_per_op\": null, \"allocs\": null, "
+             "\"reallocs\": null, \"peak_rss_kb\": %ld}\n",
+             b.name, n, ns / n, ru.ru_maxrss);
+      fflush(stdout);
+      _exit(0);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0)
+      failed = 1;
+  }
+  return failed;
+}
@@ -1,65 +1,837 @@
+#define _GNU_SOURCE
 #include "dss.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
-#define DSS_HDR(s) ((dss_hdr *)((char *)s - sizeof(dss_hdr)))
+#ifdef __GLIBC__
+#define DSS_LIBC_USABLE_SIZE malloc_usable_size
+#else
+#define DSS_LIBC_USABLE_SIZE NULL
+#endif
 
-typedef struct __attribute__((__packed__)) {
-  /*size of allocated memory in bytes for struct dss_hdr and buf */
-  uint64_t size;
-  /* Number of bytes occupied in buf. len is total bytes in buf + null term.
-   * That's why creating empty dss string using dss_empty should result in
-   * len=1.*/
-  uint64_t len;
-  /*Tracks the number of references created. */
-  uint32_t ref_count;
-  char buf[];
-} dss_hdr;
+/* Allocator every heap allocation of dss goes through, see
+ * dss_set_allocator. */
+static dss_allocator dss_mem = {malloc, realloc, free, DSS_LIBC_USABLE_SIZE};
 
-/*It reallocates memory if required otherwise returns the same address
- * This function can be optimized further as per the benchmarks.*/
-static dss_hdr *dss_expand(dss_hdr *hdr, size_t len) {
+#define dss_malloc(n) (dss_mem.malloc_fn(n))
+#define dss_realloc(p, n) (dss_mem.realloc_fn((p), (n)))
+#define dss_dealloc(p) (dss_mem.free_fn(p))
 
-  /* DSS_NULLT is not included in calculating size_t needed because
-   * hdr->len already includes null term*/
-  size_t needed = hdr->len + len;
-  size_t total = hdr->size - sizeof(dss_hdr);
+#define DSS_FLAGS(s) (((uint8_t *)(s))[-2])
 
-  if (needed <= total)
-    return hdr;
+#define DSS_FLAG_GROWTH_MASK 0x07
+/* ref_count is updated with atomic operations */
+#define DSS_FLAG_ATOMIC 0x08
+/* The string lives inside a dss_arena block and must never be passed to
+ * realloc or free */
+#define DSS_FLAG_ARENA 0x10
+/* The string lives in its own anonymous mapping, see dss_set_mmap_threshold
+ */
+#define DSS_FLAG_MMAP 0x20
+/* The hash field holds the hash of the current bytes, see DSS_HASH_CACHE */
+#define DSS_FLAG_HASHED 0x40
+/* The bytes are an LZ4 block, see dss_compress */
+#define DSS_FLAG_COMPRESSED 0x80
+
+/* Flags that describe where the bytes of a string are stored */
+#define DSS_STORAGE_FLAGS (DSS_FLAG_ARENA | DSS_FLAG_MMAP)
+
+/* What is known about the string being UTF-8, kept in the bits of the type
+ * byte above the header class. VALID means all the bytes are valid UTF-8,
+ * except that the last sequence may still be incomplete; INVALID that they
+ * can't become valid by appending more. Neither bit means unknown. */
+#define DSS_UTF8_VALID 0x04
+#define DSS_UTF8_INVALID 0x08
+#define DSS_UTF8_MASK (DSS_UTF8_VALID | DSS_UTF8_INVALID)
+#define DSS_TYPEBYTE(s) (((unsigned char *)(s))[-1])
+
+/* Statistics, see DSS_STATS in dss.h. Every thread counts into its own
+ * block, registered on first use, so the counted paths never share a cache
+ * line; a block is folded into dss_stats_retired when its thread exits.
+ * dss_stats_get sums them under a lock, the counters being read with
+ * relaxed atomic loads while their threads keep updating them. The gauges
+ * are deltas that a single thread may see go below 0, they add up in
+ * modulo arithmetic. */
+#ifdef DSS_STATS
+typedef struct dss_stats_tls {
+  dss_stats s;
+  struct dss_stats_tls *next;
+  struct dss_stats_tls **pprev;
+  /* 0 before the first update, 1 while in the list, 2 once exited */
+  int state;
+} dss_stats_tls;
+
+#define DSS_STATS_WORDS (sizeof(dss_stats) / sizeof(uint64_t))
+
+static __thread dss_stats_tls dss_st;
+static dss_stats_tls *dss_stats_threads;
+/* Counts of the threads that exited */
+static dss_stats dss_stats_retired;
+/* Counts at the last dss_stats_reset */
+static dss_stats dss_stats_base;
+static pthread_mutex_t dss_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t dss_stats_key;
+static pthread_once_t dss_stats_once = PTHREAD_ONCE_INIT;
+
+static void dss_stats_exit(void *p) {
+  dss_stats_tls *t = p;
+  uint64_t *from = (uint64_t *)&t->s, *to = (uint64_t *)&dss_stats_retired;
+  pthread_mutex_lock(&dss_stats_lock);
+  for (size_t i = 0; i < DSS_STATS_WORDS; i++)
+    to[i] += from[i];
+  *t->pprev = t->next;
+  if (t->next)
+    t->next->pprev = t->pprev;
+  pthread_mutex_unlock(&dss_stats_lock);
+  /* What later destructors do is no longer counted */
+  t->state = 2;
+}
+
+static void dss_stats_key_init(void) {
+  if (pthread_key_create(&dss_stats_key, dss_stats_exit) != 0)
+    perror("pthread_key_create");
+}
+
+static void dss_stats_register(void) {
+  pthread_once(&dss_stats_once, dss_stats_key_init);
+  pthread_mutex_lock(&dss_stats_lock);
+  dss_st.next = dss_stats_threads;
+  if (dss_st.next)
+    dss_st.next->pprev = &dss_st.next;
+  dss_st.pprev = &dss_stats_threads;
+  dss_stats_threads = &dss_st;
+  pthread_mutex_unlock(&dss_stats_lock);
+  pthread_setspecific(dss_stats_key, &dss_st);
+  dss_st.state = 1;
+}
+
+static inline void dss_stat_add(uint64_t *c, uint64_t n) {
+  if (dss_st.state == 0)
+    dss_stats_register();
+  __atomic_store_n(c, *c + n, __ATOMIC_RELAXED);
+}
+
+/* Bucket of the realloc histogram for a new capacity of 'cap' */
+static inline int dss_stat_bucket(size_t cap) {
+  int b = cap ? 63 - __builtin_clzll((unsigned long long)cap) : 0;
+  return b < DSS_STATS_BUCKETS ? b : DSS_STATS_BUCKETS - 1;
+}
+
+#define DSS_STAT_ADD(field, n) dss_stat_add(&dss_st.s.field, (uint64_t)(n))
+#define DSS_STAT_REALLOC(cap)                                                  \
+  do {                                                                         \
+    DSS_STAT_ADD(reallocs, 1);                                                 \
+    DSS_STAT_ADD(realloc_hist[dss_stat_bucket(cap)], 1);                       \
+  } while (0)
+#else
+/* The arguments are not evaluated, sizeof only keeps the variables that
+ * are computed for them from being reported as unused */
+#define DSS_STAT_ADD(field, n) ((void)sizeof(n))
+#define DSS_STAT_REALLOC(cap) ((void)sizeof(cap))
+#endif
+
+#ifdef DSS_STATS
+/* Sum of the blocks of all threads, called with dss_stats_lock held */
+static void dss_stats_sum(dss_stats *out) {
+  uint64_t *to = (uint64_t *)out;
+  memcpy(out, &dss_stats_retired, sizeof(dss_stats));
+  for (dss_stats_tls *t = dss_stats_threads; t; t = t->next) {
+    uint64_t *from = (uint64_t *)&t->s;
+    for (size_t i = 0; i < DSS_STATS_WORDS; i++)
+      to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+  }
+}
+
+/* Whether word 'i' of dss_stats is a gauge, which reset leaves alone */
+static inline int dss_stats_gauge(size_t i) {
+  return i == offsetof(dss_stats, live_len) / sizeof(uint64_t) ||
+         i == offsetof(dss_stats, live_cap) / sizeof(uint64_t);
+}
+#endif
+
+/* Fills 'st' with the counts of all threads since the last dss_stats_reset.
+ * Returns 0, or -1 with errno set to ENOSYS when dss.c was built without
+ * DSS_STATS, 'st' being zeroed. */
+int dss_stats_get(dss_stats *st) {
+#ifdef DSS_STATS
+  pthread_mutex_lock(&dss_stats_lock);
+  dss_stats_sum(st);
+  uint64_t *to = (uint64_t *)st, *base = (uint64_t *)&dss_stats_base;
+  for (size_t i = 0; i < DSS_STATS_WORDS; i++)
+    if (!dss_stats_gauge(i))
+      to[i] -= base[i];
+  pthread_mutex_unlock(&dss_stats_lock);
+  return 0;
+#else
+  memset(st, 0, sizeof(dss_stats));
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/* Starts the counters over. Threads are not stopped, the counts taken so
+ * far are remembered and subtracted by dss_stats_get. */
+void dss_stats_reset(void) {
+#ifdef DSS_STATS
+  pthread_mutex_lock(&dss_stats_lock);
+  dss_stats_sum(&dss_stats_base);
+  pthread_mutex_unlock(&dss_stats_lock);
+#endif
+}
+
+/* USDT probes of provider "dss", see DSS_USDT in dss.h */
+#if defined(DSS_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define DSS_PROBE2(name, a, b) DTRACE_PROBE2(dss, name, a, b)
+#define DSS_PROBE3(name, a, b, c) DTRACE_PROBE3(dss, name, a, b, c)
+#endif
+#endif
+#ifndef DSS_PROBE2
+#define DSS_PROBE2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+#define DSS_PROBE3(name, a, b, c)                                              \
+  ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c))
+#endif
+
+/* Smallest header class whose size field can hold 'cap' */
+static inline int dss_req_type(size_t cap) {
+  if (cap <= UINT8_MAX)
+    return DSS_TYPE_8;
+  if (cap <= UINT16_MAX)
+    return DSS_TYPE_16;
+  if ((uint64_t)cap <= UINT32_MAX)
+    return DSS_TYPE_32;
+  return DSS_TYPE_64;
+}
+
+/* ref_count leads every header class, so the start of the header is also
+ * the address of the counter. */
+static inline uint32_t *dss_refp(const dss s) {
+  return (uint32_t *)dss_hdr_start(s);
+}
+
+/* Writes the len field alone, see dss_setlen */
+static inline void dss_putlen(dss s, size_t len) {
+  switch (DSS_TYPE(s)) {
+  case DSS_TYPE_8:
+    DSS_HDR(8, s)->len = (uint8_t)len;
+    break;
+  case DSS_TYPE_16:
+    DSS_HDR(16, s)->len = (uint16_t)len;
+    break;
+  case DSS_TYPE_32:
+    DSS_HDR(32, s)->len = (uint32_t)len;
+    break;
+  default:
+    DSS_HDR(64, s)->len = len;
+    break;
+  }
+}
+
+/* Every function that changes the bytes of a string ends up setting its
+ * length, which is where cached metadata is dropped. */
+static inline void dss_setlen(dss s, size_t len) {
+#ifdef DSS_HASH_CACHE
+  DSS_FLAGS(s) &= ~DSS_FLAG_HASHED;
+#endif
+  /* Nothing is known about the new bytes, except that there are none */
+  DSS_TYPEBYTE(s) &= ~DSS_UTF8_MASK;
+  if (len == DSS_NULLT)
+    DSS_TYPEBYTE(s) |= DSS_UTF8_VALID;
+#ifdef DSS_STATS
+  /* Arena strings are not counted as live, they are never released one by
+   * one */
+  if (!(DSS_FLAGS(s) & DSS_FLAG_ARENA))
+    DSS_STAT_ADD(live_len, len - dss_getlen(s));
+#endif
+  dss_putlen(s, len);
+}
+
+static inline void dss_setcap(dss s, size_t cap) {
+  switch (DSS_TYPE(s)) {
+  case DSS_TYPE_8:
+    DSS_HDR(8, s)->size = (uint8_t)cap;
+    break;
+  case DSS_TYPE_16:
+    DSS_HDR(16, s)->size = (uint16_t)cap;
+    break;
+  case DSS_TYPE_32:
+    DSS_HDR(32, s)->size = (uint32_t)cap;
+    break;
+  default:
+    DSS_HDR(64, s)->size = cap;
+    break;
+  }
+}
+
+/* Largest capacity the size field of a header class can describe */
+static inline size_t dss_type_max(int type) {
+  switch (type) {
+  case DSS_TYPE_8:
+    return UINT8_MAX;
+  case DSS_TYPE_16:
+    return UINT16_MAX;
+  case DSS_TYPE_32:
+    return UINT32_MAX;
+  }
+  return SIZE_MAX;
+}
+
+/* The allocator usually rounds requests up to a bucket size. When it can
+ * tell how big the block at 'sh' really is, the slack is handed to buf so
+ * that later appends can use it without calling realloc. 'cap' is what was
+ * requested for buf. */
+static inline size_t dss_usable_cap(void *sh, int type, size_t cap) {
+  if (!dss_mem.usable_size_fn)
+    return cap;
+  size_t hdrlen = dss_hdr_size(type);
+  size_t usable = dss_mem.usable_size_fn(sh);
+  if (usable <= hdrlen + cap)
+    return cap;
+  usable -= hdrlen;
+  if (usable > dss_type_max(type))
+    usable = dss_type_max(type);
+  return usable;
+}
+
+/* Writes a fresh header of class 'type' at the start of 'mem' and returns
+ * the string that follows it. len is set to DSS_NULLT, i.e. an empty
+ * string. */
+static inline dss dss_hdr_init(void *mem, int type, size_t cap) {
+  dss s = (char *)mem + dss_hdr_size(type);
+  *(uint32_t *)mem = 1;
+  DSS_FLAGS(s) = 0;
+  s[-1] = (char)type;
+  dss_setcap(s, cap);
+#ifdef DSS_STATS
+  /* dss_setlen counts the change from the previous length */
+  dss_putlen(s, DSS_NULLT);
+#endif
+  dss_setlen(s, DSS_NULLT);
+  return s;
+}
+
+#ifdef DSS_HASH_CACHE
+static inline void *dss_hashp(const dss s) {
+  return (char *)dss_hdr_start(s) + sizeof(uint32_t);
+}
+#endif
+
+/* Carries ref_count, attributes and cached metadata of 's' over to 'ns', a
+ * fresh copy of its bytes. Where the bytes of 's' were stored is not
+ * inherited. */
+static inline void dss_copy_meta(dss ns, const dss s) {
+  *dss_refp(ns) = *dss_refp(s);
+  DSS_FLAGS(ns) |= DSS_FLAGS(s) & ~DSS_STORAGE_FLAGS;
+  DSS_TYPEBYTE(ns) = (DSS_TYPEBYTE(ns) & ~DSS_UTF8_MASK) |
+                     (DSS_TYPEBYTE(s) & DSS_UTF8_MASK);
+#ifdef DSS_HASH_CACHE
+  memcpy(dss_hashp(ns), dss_hashp(s), sizeof(uint64_t));
+#endif
+}
+
+static inline int dss_is_atomic(const dss s) {
+#ifdef DSS_ATOMIC_REFCOUNT
+  (void)s;
+  return 1;
+#else
+  return DSS_FLAGS(s) & DSS_FLAG_ATOMIC;
+#endif
+}
+
+static inline uint32_t dss_ref_load(const dss s) {
+  if (dss_is_atomic(s))
+    return __atomic_load_n(dss_refp(s), __ATOMIC_ACQUIRE);
+  return *dss_refp(s);
+}
+
+/* Taking a new reference only needs the increment itself to be atomic, the
+ * handoff to the other thread is what publishes the string. A count of 1
+ * means nobody else can be looking at the counter, so the read-modify-write
+ * is skipped. A DSS_REF_STATIC count is never written, the string may be in
+ * read-only memory. */
+static inline void dss_ref_incr(dss s) {
+  uint32_t *rc = dss_refp(s);
+  if (!dss_is_atomic(s)) {
+    if (*rc != DSS_REF_STATIC)
+      (*rc)++;
+    return;
+  }
+  uint32_t n = __atomic_load_n(rc, __ATOMIC_RELAXED);
+  if (n == 1)
+    __atomic_store_n(rc, 2, __ATOMIC_RELAXED);
+  else if (n != DSS_REF_STATIC)
+    __atomic_fetch_add(rc, 1, __ATOMIC_RELAXED);
+}
+
+/* Takes 'n' references at once */
+static inline void dss_ref_add(dss s, uint32_t n) {
+  if (dss_ref_load(s) == DSS_REF_STATIC)
+    return;
+  if (dss_is_atomic(s))
+    __atomic_fetch_add(dss_refp(s), n, __ATOMIC_RELAXED);
+  else
+    *dss_refp(s) += n;
+}
+
+/* Drops a reference and returns how many are left. The decrement is acq-rel
+ * so that writes made by other owners are visible before the last one frees
+ * the buffer. A sole owner skips the atomic operation entirely. */
+static inline uint32_t dss_ref_decr(dss s) {
+  uint32_t *rc = dss_refp(s);
+  if (!dss_is_atomic(s))
+    return *rc == DSS_REF_STATIC ? DSS_REF_STATIC : --*rc;
+  uint32_t n = __atomic_load_n(rc, __ATOMIC_ACQUIRE);
+  if (n == 1) {
+    *rc = 0;
+    return 0;
+  }
+  if (n == DSS_REF_STATIC)
+    return n;
+  return __atomic_sub_fetch(rc, 1, __ATOMIC_ACQ_REL);
+}
+
+static dss_growth_policy dss_default_growth = DSS_DEFAULT_GROWTH;
+static size_t dss_growth_threshold = DSS_GROWTH_THRESHOLD;
+static size_t dss_growth_step = DSS_GROWTH_STEP;
+
+/* Resolves the policy stored in the header, falling back to the global
+ * default when the string has no override. */
+static inline dss_growth_policy dss_hdr_growth(const dss s) {
+  dss_growth_policy p =
+      (dss_growth_policy)(DSS_FLAGS(s) & DSS_FLAG_GROWTH_MASK);
+  if (p == DSS_GROWTH_DEFAULT)
+    p = dss_default_growth;
+  return p;
+}
+
+/* Computes the capacity of buf that should be allocated to hold 'needed'
+ * bytes when the current capacity is 'total'. Every policy returns at least
+ * 'needed', also when the multiplication overflows. */
+static size_t dss_next_cap(dss_growth_policy policy, size_t total,
+                           size_t needed) {
+  size_t new_cap;
+
+  switch (policy) {
+  case DSS_GROWTH_EXACT:
+    return needed;
+  case DSS_GROWTH_ONE_HALF:
+    new_cap = total + total / 2;
+    if (new_cap < needed)
+      new_cap = needed + needed / 2;
+    break;
+  case DSS_GROWTH_CAPPED:
+    /* Behaves like doubling for small buffers. Past the threshold, a fixed
+     * step is added so that a huge buffer never preallocates its own size
+     * again. */
+    if (needed >= dss_growth_threshold) {
+      new_cap = needed + dss_growth_step;
+      break;
+    }
+    /* fall through */
+  case DSS_GROWTH_DOUBLE:
+  default:
+    /* Increase size by two times the length of t.
+     * This approach is taken to minimize realloc call
+     * everytime dss_concat is called. */
+    new_cap = total * 2;
+    if (new_cap < needed)
+      new_cap = needed * 2;
+    break;
+  }
 
-  /* Increase size by two times the length of t.
-   * This approach is taken to minimize realloc call
-   * everytime dss_concat is called.
-   *
-   * More optimizations to be done for this.
-   */
-  size_t new_cap = total * 2;
   if (new_cap < needed)
-    new_cap = needed * 2;
+    new_cap = needed;
+  return new_cap;
+}
+
+static size_t dss_mmap_threshold = DSS_MMAP_THRESHOLD;
+
+static inline size_t dss_page_round(size_t n) {
+  static size_t page;
+  if (!page)
+    page = (size_t)sysconf(_SC_PAGESIZE);
+  return (n + page - 1) & ~(page - 1);
+}
+
+/* Allocations of at least the threshold get their own mapping */
+static inline int dss_wants_mmap(size_t total) {
+  return dss_mmap_threshold && total >= dss_mmap_threshold;
+}
+
+/* Length of the mapping of a DSS_FLAG_MMAP string. buf is given the whole
+ * page rounded mapping, so this is only off by the clamping to the size
+ * field of the class, which is less than a page. */
+static inline size_t dss_map_len(const dss s) {
+  return dss_page_round(dss_hdr_size(DSS_TYPE(s)) + dss_getcap(s));
+}
+
+/* Capacity of buf in a mapping of 'maplen' bytes */
+static inline size_t dss_map_cap(size_t maplen, int type) {
+  size_t cap = maplen - dss_hdr_size(type);
+  if (cap > dss_type_max(type))
+    cap = dss_type_max(type);
+  return cap;
+}
+
+/* Thread cache. Freed heap blocks of up to DSS_TCACHE_MAX_BLOCK bytes are
+ * kept on per-thread lists, one per power of two size class, and handed out
+ * again by dss_alloc without going through the allocator. While the cache
+ * is on, small strings are allocated with the full size of their class so
+ * that any block of a class fits any request of it. Blocks are plain
+ * allocator blocks: a string freed by another thread than the one that
+ * allocated it simply lands in the cache of the freeing thread. A thread
+ * gives its blocks back to the allocator when it exits. */
+
+#define DSS_TCACHE_MIN_SHIFT 5
+#define DSS_TCACHE_CLASSES 4
+#define DSS_TCACHE_MAX_BLOCK                                                   \
+  ((size_t)1 << (DSS_TCACHE_MIN_SHIFT + DSS_TCACHE_CLASSES - 1))
+
+typedef struct dss_tcache_block {
+  struct dss_tcache_block *next;
+} dss_tcache_block;
+
+typedef struct {
+  dss_tcache_block *head[DSS_TCACHE_CLASSES];
+  size_t count[DSS_TCACHE_CLASSES];
+  int registered;
+} dss_tcache;
+
+/* Blocks kept per class and per thread, 0 when the cache is off. It can be
+ * changed while other threads allocate, so it is only accessed through
+ * relaxed atomics: a thread may go on with the old limit for a few calls,
+ * which is harmless as every block fits the class it is put in. */
+static size_t dss_tcache_max = DSS_THREAD_CACHE;
+static __thread dss_tcache dss_tc;
+
+static inline size_t dss_tcache_limit(void) {
+  return __atomic_load_n(&dss_tcache_max, __ATOMIC_RELAXED);
+}
+static pthread_key_t dss_tcache_key;
+static pthread_once_t dss_tcache_once = PTHREAD_ONCE_INIT;
+
+static void dss_tcache_drain(dss_tcache *tc) {
+  for (int i = 0; i < DSS_TCACHE_CLASSES; i++) {
+    dss_tcache_block *b = tc->head[i];
+    while (b) {
+      dss_tcache_block *next = b->next;
+      dss_dealloc(b);
+      b = next;
+    }
+    tc->head[i] = NULL;
+    tc->count[i] = 0;
+  }
+}
+
+/* Strings freed by destructors that run later register the cache again */
+static void dss_tcache_exit(void *tc) {
+  dss_tcache_drain(tc);
+  ((dss_tcache *)tc)->registered = 0;
+}
+
+static void dss_tcache_key_init(void) {
+  if (pthread_key_create(&dss_tcache_key, dss_tcache_exit) != 0)
+    perror("pthread_key_create");
+}
+
+/* Size class of a request of 'total' bytes, rounding up */
+static inline int dss_tcache_class(size_t total) {
+  int c = 0;
+  while (((size_t)1 << (DSS_TCACHE_MIN_SHIFT + c)) < total)
+    c++;
+  return c;
+}
+
+static inline void *dss_tcache_get(int c) {
+  dss_tcache_block *b = dss_tc.head[c];
+  if (b) {
+    dss_tc.head[c] = b->next;
+    dss_tc.count[c]--;
+  }
+  return b;
+}
+
+/* Keeps the heap block at 'sh' of 'total' bytes. Returns 0 when the block
+ * must go back to the allocator instead. */
+static inline int dss_tcache_put(void *sh, size_t total) {
+  if (total < ((size_t)1 << DSS_TCACHE_MIN_SHIFT) ||
+      total > DSS_TCACHE_MAX_BLOCK)
+    return 0;
+  /* Largest class the block covers */
+  int c = dss_tcache_class(total);
+  if (((size_t)1 << (DSS_TCACHE_MIN_SHIFT + c)) > total)
+    c--;
+  if (dss_tc.count[c] >= dss_tcache_limit())
+    return 0;
+  if (!dss_tc.registered) {
+    /* The key only exists to drain the cache when the thread exits */
+    pthread_once(&dss_tcache_once, dss_tcache_key_init);
+    pthread_setspecific(dss_tcache_key, &dss_tc);
+    dss_tc.registered = 1;
+  }
+  dss_tcache_block *b = sh;
+  b->next = dss_tc.head[c];
+  dss_tc.head[c] = b;
+  dss_tc.count[c]++;
+  return 1;
+}
+
+/* Sets how many freed blocks every thread keeps per size class. 0 turns the
+ * cache off, which is the default unless DSS_THREAD_CACHE says otherwise.
+ * Blocks already cached stay until dss_thread_cache_flush or the exit of
+ * their thread. */
+void dss_set_thread_cache(size_t blocks) {
+  __atomic_store_n(&dss_tcache_max, blocks, __ATOMIC_RELAXED);
+}
+
+/* Gives the blocks cached by the calling thread back to the allocator */
+void dss_thread_cache_flush(void) { dss_tcache_drain(&dss_tc); }
+
+/* Counts a string fresh out of dss_alloc */
+static inline dss dss_alloc_done(dss s) {
+  DSS_STAT_ADD(allocs, 1);
+  DSS_STAT_ADD(live_len, DSS_NULLT);
+  DSS_STAT_ADD(live_cap, dss_getcap(s));
+  DSS_PROBE2(alloc, s, dss_getcap(s));
+  return s;
+}
+
+/* Allocates an empty string with room for at least 'cap' bytes in buf,
+ * behind the smallest header class that fits. Huge strings are mapped
+ * directly from the kernel, everything else comes from the allocator. */
+static dss dss_alloc(size_t cap) {
+  int type = dss_req_type(cap);
+  size_t total = dss_hdr_size(type) + cap;
+  void *sh;
+  dss s;
+
+  if (dss_wants_mmap(total)) {
+    size_t maplen = dss_page_round(total);
+    sh = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+              -1, 0);
+    if (sh == MAP_FAILED) {
+      perror("mmap failed");
+      return NULL;
+    }
+    s = dss_hdr_init(sh, type, dss_map_cap(maplen, type));
+    DSS_FLAGS(s) |= DSS_FLAG_MMAP;
+    return dss_alloc_done(s);
+  }
+
+  if (dss_tcache_limit() && total <= DSS_TCACHE_MAX_BLOCK) {
+    int c = dss_tcache_class(total);
+    total = (size_t)1 << (DSS_TCACHE_MIN_SHIFT + c);
+    cap = total - dss_hdr_size(type);
+    /* The class size may not fit the size field of the class */
+    if (cap > dss_type_max(type))
+      cap = dss_type_max(type);
+    /* The slack of the allocator is not used, so that the block is found
+     * in the same class again when it is freed */
+    sh = dss_tcache_get(c);
+    if (!sh)
+      sh = dss_malloc(total);
+    if (!sh) {
+      fprintf(stderr, "Not able to allocate memory.");
+      return NULL;
+    }
+    return dss_alloc_done(dss_hdr_init(sh, type, cap));
+  }
+
+  sh = dss_malloc(total);
+  if (!sh) {
+    fprintf(stderr, "Not able to allocate memory.");
+    return NULL;
+  }
+  return dss_alloc_done(dss_hdr_init(sh, type, dss_usable_cap(sh, type, cap)));
+}
+
+/* Gives the memory of the string back to wherever it came from */
+static void dss_release(dss s) {
+  uint8_t flags = DSS_FLAGS(s);
+  if (flags & DSS_FLAG_ARENA)
+    return;
+  DSS_STAT_ADD(frees, 1);
+  DSS_STAT_ADD(live_len, -dss_getlen(s));
+  DSS_STAT_ADD(live_cap, -dss_getcap(s));
+  DSS_PROBE2(free, s, dss_getcap(s));
+  if (flags & DSS_FLAG_MMAP) {
+    munmap(dss_hdr_start(s), dss_map_len(s));
+    return;
+  }
+  size_t total = dss_hdr_size(DSS_TYPE(s)) + dss_getcap(s);
+  if (!dss_tcache_limit() || !dss_tcache_put(dss_hdr_start(s), total))
+    dss_dealloc(dss_hdr_start(s));
+}
+
+#ifdef MREMAP_MAYMOVE
+/* Resizes the mapping of a DSS_FLAG_MMAP string with mremap, which moves
+ * page table entries instead of copying bytes. When the header class
+ * changes, buf is shifted within the mapping. */
+static dss dss_remap(dss s, size_t cap) {
+  int oldtype = DSS_TYPE(s);
+  int type = dss_req_type(cap);
+  size_t oldhdr = dss_hdr_size(oldtype);
+  size_t hdrlen = dss_hdr_size(type);
+  size_t len = dss_getlen(s);
+  size_t oldmap = dss_map_len(s);
+  size_t maplen = dss_page_round(hdrlen + cap);
+  size_t oldcap = dss_getcap(s);
+  uint32_t rc = *dss_refp(s);
+  uint8_t flags = DSS_FLAGS(s);
+  unsigned char utf8 = DSS_TYPEBYTE(s) & DSS_UTF8_MASK;
+  char *sh = dss_hdr_start(s);
 
-  hdr = realloc(hdr, sizeof(dss_hdr) + new_cap);
-  if (!hdr) {
-    perror("realloc failed");
+  /* A narrower header moves buf down before the mapping shrinks */
+  if (hdrlen < oldhdr)
+    memmove(sh + hdrlen, sh + oldhdr, len);
+
+  char *newsh = mremap(sh, oldmap, maplen, MREMAP_MAYMOVE);
+  if (newsh == MAP_FAILED) {
+    if (hdrlen < oldhdr)
+      memmove(sh + oldhdr, sh + hdrlen, len);
+    perror("mremap failed");
     return NULL;
   }
-  hdr->size = sizeof(dss_hdr) + new_cap;
-  return hdr;
+
+  if (hdrlen > oldhdr)
+    memmove(newsh + hdrlen, newsh + oldhdr, len);
+
+  s = dss_hdr_init(newsh, type, dss_map_cap(maplen, type));
+  /* The bytes and what is cached about them are unchanged */
+  dss_putlen(s, len);
+  DSS_STAT_ADD(live_cap, dss_getcap(s) - oldcap);
+  DSS_PROBE3(resize, s, oldcap, dss_getcap(s));
+  *(uint32_t *)newsh = rc;
+  DSS_FLAGS(s) = flags;
+  DSS_TYPEBYTE(s) = (DSS_TYPEBYTE(s) & ~DSS_UTF8_MASK) | utf8;
+  return s;
+}
+#endif
+
+/* Moves the string into an allocation whose buf holds at least 'cap' bytes.
+ * The header class is picked again for the new capacity; while it stays the
+ * same a plain realloc is enough, otherwise the bytes are copied behind a
+ * header of the new class. The caller makes sure len fits into 'cap'.
+ *
+ * Mapped strings are resized with mremap, and strings crossing the mmap
+ * threshold are copied between the heap and a mapping.
+ *
+ * Arena strings are copied to the heap instead. Their old bytes stay in the
+ * arena until it is reset, and the copy is an ordinary string from then on.
+ */
+static dss dss_resize(dss s, size_t cap) {
+  int oldtype = DSS_TYPE(s);
+  int type = dss_req_type(cap);
+  size_t hdrlen = dss_hdr_size(type);
+  uint8_t flags = DSS_FLAGS(s);
+  int mapped = dss_wants_mmap(hdrlen + cap);
+  /* Small blocks move between the classes of the thread cache instead */
+  int cached = dss_tcache_limit() && hdrlen + cap <= DSS_TCACHE_MAX_BLOCK;
+
+  DSS_STAT_REALLOC(cap);
+
+#ifdef MREMAP_MAYMOVE
+  if ((flags & DSS_FLAG_MMAP) && mapped)
+    return dss_remap(s, cap);
+#endif
+
+  if (type == oldtype && !mapped && !cached &&
+      !(flags & (DSS_FLAG_ARENA | DSS_FLAG_MMAP))) {
+    void *newsh = dss_realloc(dss_hdr_start(s), hdrlen + cap);
+    if (!newsh) {
+      perror("realloc failed");
+      return NULL;
+    }
+    s = (char *)newsh + hdrlen;
+    size_t oldcap = dss_getcap(s);
+    dss_setcap(s, dss_usable_cap(newsh, type, cap));
+    DSS_STAT_ADD(live_cap, dss_getcap(s) - oldcap);
+    DSS_PROBE3(resize, s, oldcap, dss_getcap(s));
+    return s;
+  }
+
+  size_t len = dss_getlen(s);
+  dss ns = dss_alloc(cap);
+  if (!ns)
+    return NULL;
+  DSS_STAT_ADD(copied_bytes, len);
+  DSS_PROBE3(resize, ns, dss_getcap(s), dss_getcap(ns));
+  memcpy(ns, s, len);
+  dss_setlen(ns, len);
+  dss_copy_meta(ns, s);
+  dss_release(s);
+  return ns;
+}
+
+static dss dss_readable(const dss s);
+static void dss_readable_done(const dss s, dss p);
+
+/* Functions that change the string start from its plain bytes */
+static inline dss dss_plain(dss s) {
+  if (DSS_FLAGS(s) & DSS_FLAG_COMPRESSED)
+    return dss_decompress(s);
+  return s;
+}
+
+/*It reallocates memory if required otherwise returns the same address.
+ * How much extra room is reserved is decided by the growth policy of the
+ * string, see dss_set_growth_policy.*/
+static dss dss_expand(dss s, size_t len) {
+  s = dss_plain(s);
+  if (!s)
+    return NULL;
+
+  /* DSS_NULLT is not included in calculating size_t needed because
+   * the len in the header already includes null term*/
+  size_t needed = dss_getlen(s) + len;
+  size_t total = dss_getcap(s);
+
+  if (needed <= total)
+    return s;
+
+  size_t new_cap = dss_next_cap(dss_hdr_growth(s), total, needed);
+
+  return dss_resize(s, new_cap);
 }
 
 /* Appends byte and add null term at the end */
-static inline dss_hdr *dss_append_bytes(dss_hdr *hdr, const void *t,
-                                        size_t len) {
+static inline dss dss_append_bytes(dss s, const void *t, size_t len) {
+  size_t curlen = dss_getlen(s);
   /* In the below memcpy DSS_NULLT is subtracted because copy should
    * happen from the current position of null terminator */
-  memcpy(hdr->buf + hdr->len - DSS_NULLT, t, len);
-  hdr->len = hdr->len + len;
-  hdr->buf[hdr->len - 1] = '\0';
-  return hdr;
+  memcpy(s + curlen - DSS_NULLT, t, len);
+  curlen += len;
+  dss_setlen(s, curlen);
+  s[curlen - 1] = '\0';
+  return s;
+}
+
+static void dss_utf8_update(dss s, unsigned char utf8, size_t from);
+
+/* dss_append_bytes that keeps track of the string being UTF-8 */
+static inline dss dss_append_utf8(dss s, const void *t, size_t len) {
+  unsigned char utf8 = DSS_TYPEBYTE(s) & DSS_UTF8_MASK;
+  size_t from = dss_getlen(s) - DSS_NULLT;
+  dss_append_bytes(s, t, len);
+  dss_utf8_update(s, utf8, from);
+  return s;
 }
 
 dss dss_new(const char *s) {
@@ -68,24 +840,19 @@ dss dss_new(const char *s) {
 }
 
 dss dss_newb(const void *s, size_t len) {
-  dss_hdr *hdr = (dss_hdr *)malloc(sizeof(dss_hdr) + len + DSS_NULLT);
-
-  if (!hdr) {
-    fprintf(stderr, "Not able to allocate memory.");
+  dss ns = dss_alloc(len + DSS_NULLT);
+  if (!ns)
     return NULL;
-  }
 
-  hdr->size = sizeof(dss_hdr) + len + DSS_NULLT;
-  /* hdr->len totals with DSS_NULLT because hdr->len means number of bytes
+  /* len totals with DSS_NULLT because len means number of bytes
    * currently occupied in the buf which includes the null terminator as well.
    */
-  hdr->len = len + DSS_NULLT;
+  dss_setlen(ns, len + DSS_NULLT);
 
-  memcpy(hdr->buf, (const char *)s, len);
-  hdr->buf[len] = '\0';
-  hdr->ref_count = 1;
+  memcpy(ns, (const char *)s, len);
+  ns[len] = '\0';
 
-  return hdr->buf;
+  return ns;
 }
 
 dss dss_concat(dss s, const char *t) {
@@ -94,35 +861,92 @@ dss dss_concat(dss s, const char *t) {
 }
 
 dss dss_concatb(dss s, const void *t, size_t len) {
-  dss_hdr *hdr = DSS_HDR(s);
-
   if (len == 0)
-    return hdr->buf;
+    return s;
 
   /*Reallocate memory if required*/
-  hdr = dss_expand(hdr, len);
+  s = dss_expand(s, len);
+  if (!s)
+    return NULL;
 
-  dss_append_bytes(hdr, t, len);
+  return dss_append_utf8(s, t, len);
+}
+
+/* Appends 'iovcnt' buffers at once. The lengths are summed first so the
+ * string is expanded at most once, then every piece is copied back to
+ * back. */
+dss dss_concatv(dss s, const struct iovec *iov, int iovcnt) {
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++)
+    total += iov[i].iov_len;
+  if (total == 0)
+    return s;
+
+  /*Reallocate memory if required*/
+  s = dss_expand(s, total);
+  if (!s)
+    return NULL;
 
-  return hdr->buf;
+  size_t curlen = dss_getlen(s);
+  unsigned char utf8 = DSS_TYPEBYTE(s) & DSS_UTF8_MASK;
+  char *p = s + curlen - DSS_NULLT;
+  for (int i = 0; i < iovcnt; i++) {
+    memcpy(p, iov[i].iov_base, iov[i].iov_len);
+    p += iov[i].iov_len;
+  }
+  *p = '\0';
+  dss_setlen(s, curlen + total);
+  dss_utf8_update(s, utf8, curlen - DSS_NULLT);
+  return s;
 }
 
-size_t dss_len(const dss s) {
-  dss_hdr *hdr = DSS_HDR(s);
-  return hdr->len;
+/* Appends a NULL terminated list of C strings with at most one expansion,
+ * like dss_concatv. */
+dss dss_concat_many(dss s, ...) {
+  va_list ap;
+  const char *t;
+  size_t total = 0;
+
+  va_start(ap, s);
+  while ((t = va_arg(ap, const char *)) != NULL)
+    total += strlen(t);
+  va_end(ap);
+  if (total == 0)
+    return s;
+
+  s = dss_expand(s, total);
+  if (!s)
+    return NULL;
+
+  size_t curlen = dss_getlen(s);
+  char *p = s + curlen - DSS_NULLT;
+  va_start(ap, s);
+  while ((t = va_arg(ap, const char *)) != NULL) {
+    size_t len = strlen(t);
+    memcpy(p, t, len);
+    p += len;
+  }
+  va_end(ap);
+  *p = '\0';
+  dss_setlen(s, curlen + total);
+  return s;
 }
 
 dss dss_dup(const dss s) {
-  dss_hdr *hdr = DSS_HDR(s);
-  dss_hdr *dup_hdr = (dss_hdr *)malloc(hdr->size);
-  if (!dup_hdr) {
-    fprintf(stderr, "Not able to allocate memory.");
+  size_t len = dss_getlen(s);
+  dss ds = dss_alloc(dss_getcap(s));
+  if (!ds)
     return NULL;
-  }
-  memcpy(dup_hdr, hdr, hdr->size);
-  /*Refresh the ref_count to 1*/
-  dup_hdr->ref_count = 1;
-  return dup_hdr->buf;
+  DSS_STAT_ADD(dups, 1);
+  DSS_STAT_ADD(copied_bytes, len);
+  DSS_PROBE3(dup, s, ds, len);
+  memcpy(ds, s, len);
+  dss_setlen(ds, len);
+  /*Where the original lives, in an arena or a mapping, is not inherited.
+   * The ref_count of the copy starts at 1.*/
+  dss_copy_meta(ds, s);
+  *dss_refp(ds) = 1;
+  return ds;
 }
 
 /*Create an empty dss string i.e. nothing goes in the buffer but
@@ -137,10 +961,10 @@ void dss_free(dss s) {
   /* Don't do anything if NULL*/
   if (s == NULL)
     return;
-  dss_hdr *hdr = DSS_HDR(s);
-  /* free only if ref_count equals to 0. */
-  if (--hdr->ref_count == 0) {
-    free(hdr);
+  /* free only if ref_count equals to 0. Memory of arena strings is given
+   * back by dss_arena_reset and dss_arena_destroy. */
+  if (dss_ref_decr(s) == 0) {
+    dss_release(s);
   }
 }
 
@@ -149,10 +973,50 @@ void dss_free(dss s) {
  */
 
 dss dss_refshare(dss s) {
-  DSS_HDR(s)->ref_count++;
+  dss_ref_incr(s);
   return s;
 }
 
+/* Copies 'n' bytes of 's' starting at 'from' into a new string that has room
+ * for 'extra' more bytes. Growth policy and atomic mode are kept, the
+ * ref_count of the copy is 1. */
+static dss dss_cow_copy(const dss s, size_t from, size_t n, size_t extra) {
+  dss ns = dss_alloc(n + DSS_NULLT + extra);
+  if (!ns)
+    return NULL;
+  DSS_STAT_ADD(cow_copies, 1);
+  DSS_STAT_ADD(copied_bytes, n);
+  DSS_PROBE3(cow_copy, s, ns, n);
+  memcpy(ns, s + from, n);
+  ns[n] = '\0';
+  dss_setlen(ns, n + DSS_NULLT);
+  dss_copy_meta(ns, s);
+  *dss_refp(ns) = 1;
+  if (n + DSS_NULLT != dss_getlen(s))
+    dss_touch(ns);
+  return ns;
+}
+
+/* Makes sure the caller owns the only reference to the string and that
+ * 'extra' more bytes can be appended to it without another allocation. A
+ * shared string is copied: only its bytes are, into a buffer sized for the
+ * final result, and the reference passed in is dropped. Otherwise the
+ * string is expanded with its growth policy, if needed. On failure NULL is
+ * returned and the reference passed in is left as it was. */
+dss dss_unshare_reserve(dss s, size_t extra) {
+  s = dss_plain(s);
+  if (!s)
+    return NULL;
+  if (dss_ref_load(s) <= 1)
+    return dss_expand(s, extra);
+  dss ns = dss_cow_copy(s, 0, dss_getlen(s) - DSS_NULLT, extra);
+  if (!ns)
+    return NULL;
+  /*Decrease the reference to transfer ownership back to the caller*/
+  dss_free(s);
+  return ns;
+}
+
 /* dss_concatcow implements Copy-on-write if more than 1 references is detected.
  * If multiple references is not detected then proceeds with dss_concatb.
  * Always use dss_refshare(dss s) for the first parameter dss s. The callee is
@@ -165,26 +1029,24 @@ dss dss_concatcow(dss s, const char *t) {
 }
 
 dss dss_concatcowb(dss s, const char *t, size_t len) {
-  dss_hdr *hdr = DSS_HDR(s);
-  /*check if refcount > 1, if true then apply cow*/
-  if (hdr->ref_count > 1) {
-    /*deep copy the dss string*/
-    dss dups = dss_dup(s);
-    dss_hdr *dup_hdr = DSS_HDR(dups);
-
-    if (len == 0)
-      return dup_hdr->buf;
-
-    /*Reallocate memory if required*/
-    dup_hdr = dss_expand(dup_hdr, len);
-
-    dss_append_bytes(dup_hdr, t, len);
+  /*Copy a shared string once, with room for the appended bytes*/
+  s = dss_unshare_reserve(s, len);
+  if (!s)
+    return NULL;
+  if (len == 0)
+    return s;
+  return dss_append_utf8(s, t, len);
+}
 
-    /*Decrease the reference to transfer ownership back to the caller*/
-    hdr->ref_count--;
-    return dup_hdr->buf;
-  }
-  return dss_concatb(s, t, len);
+/* Copy-on-write version of dss_concatv */
+dss dss_concatvcow(dss s, const struct iovec *iov, int iovcnt) {
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++)
+    total += iov[i].iov_len;
+  s = dss_unshare_reserve(s, total);
+  if (!s)
+    return NULL;
+  return dss_concatv(s, iov, iovcnt);
 }
 
 /*
@@ -193,73 +1055,4066 @@ dss dss_concatcowb(dss s, const char *t, size_t len) {
  * and the new space is zero-padded up to the 'len' param.
  */
 dss dss_grow(dss s, size_t len) {
-  dss_hdr *hdr = DSS_HDR(s);
-  if (len >= hdr->len) {
-    hdr = dss_expand(hdr, len);
-    memset(hdr->buf + hdr->len, 0, len);
-    hdr->len = len;
-    hdr->buf[hdr->len] = '\0';
-    return hdr->buf;
+  s = dss_plain(s);
+  if (!s)
+    return NULL;
+  size_t curlen = dss_getlen(s);
+  if (len >= curlen) {
+    /* Room for the zero padding up to and including s[len] */
+    s = dss_expand(s, len - curlen + DSS_NULLT);
+    if (!s)
+      return NULL;
+    memset(s + curlen, 0, len - curlen + DSS_NULLT);
+    dss_setlen(s, len);
+    s[len] = '\0';
   }
   return s;
 }
 
-/*Use to append any formatted string to the dss string. It accepts concat_func
- * as one of the parameters. You can use dss_concat or dss_concat or
- * dss_concatcow letting you choose the way of concatenation.
- */
-dss dss_catprintf(dss s, dss (*concat_func)(dss, const char *), const char *fmt,
-                  ...) {
-  va_list ap, cp;
-  va_start(ap, fmt);
+/* Copy-on-write version of dss_grow. A shared string is copied only when it
+ * has to grow. */
+dss dss_growcow(dss s, size_t len) {
+  s = dss_plain(s);
+  if (!s)
+    return NULL;
+  size_t curlen = dss_getlen(s);
+  if (len < curlen)
+    return s;
+  s = dss_unshare_reserve(s, len - curlen + DSS_NULLT);
+  if (!s)
+    return NULL;
+  return dss_grow(s, len);
+}
+
+/* vsnprintf that leaves errno set when it fails, to EINVAL if the libc
+ * doesn't set it */
+static int dss_vsnprintf(char *buf, size_t size, const char *fmt,
+                         va_list ap) {
+  int err = errno;
+  errno = 0;
+  int tb = vsnprintf(buf, size, fmt, ap);
+  if (tb >= 0)
+    errno = err;
+  else if (!errno)
+    errno = EINVAL;
+  return tb;
+}
+
+/* Output of a format whose arguments point into the destination goes to a
+ * buffer this large on the stack first */
+#define DSS_PRINTF_STACK 256
+
+/* Tells if one of the pointers passed to a %s or %n of 'fmt' points into
+ * [lo, hi). The arguments are walked on a copy of 'ap', following the
+ * conversions of C99 and glibc. A format the walk doesn't know, e.g. one
+ * with positional arguments, counts as aliasing. */
+static int dss_fmt_aliases(const char *fmt, va_list ap, const char *lo,
+                           const char *hi) {
+  va_list cp;
+  const char *f = fmt;
+  int alias = 0;
+
   va_copy(cp, ap);
+  while (!alias) {
+    while (*f && *f != '%')
+      f++;
+    if (!*f++)
+      break;
+    if (*f == '%') {
+      f++;
+      continue;
+    }
+    while (*f == '-' || *f == '+' || *f == ' ' || *f == '#' || *f == '0' ||
+           *f == '\'' || *f == 'I')
+      f++;
+    /* Width and precision, each maybe taken from an int argument */
+    if (*f == '*') {
+      (void)va_arg(cp, int);
+      f++;
+    }
+    while (*f >= '0' && *f <= '9')
+      f++;
+    if (*f == '.') {
+      f++;
+      if (*f == '*') {
+        (void)va_arg(cp, int);
+        f++;
+      }
+      while (*f >= '0' && *f <= '9')
+        f++;
+    }
+    if (*f == '$') {
+      alias = 1;
+      break;
+    }
 
-  /*find the total bytes needed in fmt string*/
-  int tb = vsnprintf(NULL, 0, fmt, cp);
+    /* Length modifier, 'H' standing for "hh" and 'q' for "ll" */
+    char lm = 0;
+    if (*f == 'h' || *f == 'l' || *f == 'L' || *f == 'q' || *f == 'j' ||
+        *f == 'z' || *f == 't') {
+      lm = *f++;
+      if ((lm == 'h' || lm == 'l') && *f == lm) {
+        lm = lm == 'h' ? 'H' : 'q';
+        f++;
+      }
+    }
+    char conv = *f;
+    if (conv == 'd' || conv == 'i' || conv == 'u' || conv == 'x' ||
+        conv == 'c' || conv == 'o' || conv == 'X') {
+      if (lm == 'l')
+        (void)va_arg(cp, long);
+      else if (lm == 'q' || lm == 'L')
+        (void)va_arg(cp, long long);
+      else if (lm == 'j')
+        (void)va_arg(cp, intmax_t);
+      else if (lm == 'z')
+        (void)va_arg(cp, size_t);
+      else if (lm == 't')
+        (void)va_arg(cp, ptrdiff_t);
+      else
+        (void)va_arg(cp, int);
+    } else if ((conv | 0x20) == 'e' || (conv | 0x20) == 'f' ||
+               (conv | 0x20) == 'g' || (conv | 0x20) == 'a') {
+      if (lm == 'L')
+        (void)va_arg(cp, long double);
+      else
+        (void)va_arg(cp, double);
+    } else if (conv == 'p') {
+      (void)va_arg(cp, void *);
+    } else if (conv == 's' || conv == 'n') {
+      const char *arg = va_arg(cp, const char *);
+      alias = arg >= lo && arg < hi;
+    } else if (conv != 'm') {
+      alias = 1;
+    }
+    if (*f)
+      f++;
+  }
   va_end(cp);
-  char *temp = malloc(tb + DSS_NULLT);
-  vsnprintf(temp, tb + DSS_NULLT, fmt, ap);
-  /*Expand memory for 'tb' bytes if needed is handled internally in
-   * concat_func*/
-  s = concat_func(s, temp);
-  free(temp);
-  va_end(ap);
-  return s;
+  return alias;
 }
 
-/*Returns a trimmed string between start and end. Also shrinks the buffer
- * to fit the trimmed bytes.*/
-dss dss_trim(dss s, int start, int end) {
-  dss_hdr *hdr = DSS_HDR(s);
-  uint64_t slen = hdr->len - DSS_NULLT;
+/* Formats 'fmt' into 'stack' or, when the output is larger, into a buffer
+ * to be given back with dss_dealloc. Returns the buffer and stores the
+ * length of the output in 'tb', NULL with 'tb' negative if vsnprintf
+ * failed. */
+static char *dss_format_temp(char *stack, size_t size, int *tb,
+                             const char *fmt, va_list ap) {
+  va_list cp;
+  va_copy(cp, ap);
+  *tb = dss_vsnprintf(stack, size, fmt, cp);
+  va_end(cp);
+  if (*tb < 0 || (size_t)*tb < size)
+    return *tb < 0 ? NULL : stack;
 
-  if (start < 0)
-    start = slen + start;
-  if (end < 0)
-    end = slen + end;
+  char *buf = dss_malloc((size_t)*tb + DSS_NULLT);
+  if (!buf) {
+    fprintf(stderr, "Not able to allocate memory.");
+    return NULL;
+  }
+  va_copy(cp, ap);
+  vsnprintf(buf, (size_t)*tb + DSS_NULLT, fmt, cp);
+  va_end(cp);
+  return buf;
+}
 
-  if (start < 0)
-    start = 0;
-  if ((uint64_t)start > slen)
-    start = slen;
-  if (end >= (int)slen)
-    end = slen - 1;
-  if (end < start)
-    end = start - 1;
+/* Formats straight into the free tail of the string. Most of the time the
+ * output fits into the spare capacity and a single vsnprintf is all it
+ * takes; only when it overflows the string is expanded and the format run
+ * once more. The length reported by vsnprintf is used as is, so output with
+ * embedded null bytes (e.g. "%c" with 0) is kept whole. The string is
+ * mutated like with dss_concatb. If vsnprintf fails, the string is returned
+ * unchanged with errno set.
+ *
+ * Arguments may point into the string itself, e.g. to append it to itself
+ * with "%s". Such calls are detected before anything is written and the
+ * output goes through a temporary buffer instead.
+ */
+dss dss_catvprintf(dss s, const char *fmt, va_list ap) {
+  va_list cp;
+  if (dss_fmt_aliases(fmt, ap, s, s + dss_getcap(s))) {
+    char stack[DSS_PRINTF_STACK];
+    int tb;
+    char *buf = dss_format_temp(stack, sizeof(stack), &tb, fmt, ap);
+    if (!buf)
+      return tb < 0 ? s : NULL;
+    dss ns = dss_concatb(s, buf, tb);
+    if (buf != stack)
+      dss_dealloc(buf);
+    return ns;
+  }
+
+  s = dss_plain(s);
+  if (!s)
+    return NULL;
+  size_t curlen = dss_getlen(s);
+  /* Writing starts at the current null term, so it is part of the room */
+  size_t room = dss_getcap(s) - curlen + DSS_NULLT;
+
+  va_copy(cp, ap);
+  int tb = dss_vsnprintf(s + curlen - DSS_NULLT, room, fmt, cp);
+  va_end(cp);
+  /* A bad format leaves the string as it was, NULL is kept for allocation
+   * failures */
+  if (tb < 0) {
+    s[curlen - DSS_NULLT] = '\0';
+    return s;
+  }
+
+  if ((size_t)tb >= room) {
+    dss ns = dss_expand(s, tb);
+    if (!ns) {
+      s[curlen - DSS_NULLT] = '\0';
+      return NULL;
+    }
+    s = ns;
+    va_copy(cp, ap);
+    vsnprintf(s + curlen - DSS_NULLT, (size_t)tb + DSS_NULLT, fmt, cp);
+    va_end(cp);
+  }
 
-  uint64_t new_len = end - start + DSS_NULLT;
+  dss_setlen(s, curlen + tb);
+  return s;
+}
 
-  memmove(hdr->buf, hdr->buf + start, new_len);
-  hdr->buf[new_len] = '\0';
-  hdr->len = new_len + DSS_NULLT;
+static unsigned dss_shrink_slack = DSS_SHRINK_SLACK;
 
-  /*Reallocate to shrink the buffer*/
-  hdr = (dss_hdr *)realloc(hdr, sizeof(dss_hdr) + new_len + DSS_NULLT);
-  if (!hdr) {
-    perror("realloc failed");
+/* Makes sure at least 'len' more bytes can be appended without another
+ * allocation. Unlike the implicit expansion of the appending functions,
+ * exactly the requested room is added, so a builder can be sized upfront.
+ * The length of the string is not changed. */
+dss dss_reserve(dss s, size_t len) {
+  s = dss_plain(s);
+  if (!s)
     return NULL;
-  }
-  hdr->size = sizeof(dss_hdr) + new_len + DSS_NULLT;
+  size_t curlen = dss_getlen(s);
+  if (dss_getcap(s) - curlen >= len)
+    return s;
+  return dss_resize(s, curlen + len);
+}
 
-  return hdr->buf;
+/* Makes sure at least 'len' more bytes can be written after the string,
+ * expanding it with its growth policy if needed. The new bytes are not
+ * initialized. Write them at s + dss_len(s) - DSS_NULLT, i.e. starting at
+ * the null term, then commit them with dss_incrlen. */
+dss dss_makeroom(dss s, size_t len) { return dss_expand(s, len); }
+
+/* Commits 'incr' bytes written into the room made by dss_makeroom, or with
+ * a negative 'incr' removes bytes from the end. The null term is moved
+ * accordingly. */
+void dss_incrlen(dss s, ssize_t incr) {
+  size_t len = dss_getlen(s);
+  if (incr >= 0)
+    assert(dss_getcap(s) - len >= (size_t)incr);
+  else
+    assert(len - DSS_NULLT >= (size_t)-incr);
+  len += incr;
+  dss_setlen(s, len);
+  s[len - DSS_NULLT] = '\0';
+}
+
+/* Gives all unused capacity back to the allocator */
+dss dss_shrink_to_fit(dss s) {
+  size_t len = dss_getlen(s);
+  if (dss_getcap(s) == len || (DSS_FLAGS(s) & DSS_FLAG_ARENA))
+    return s;
+  DSS_STAT_ADD(shrinks, 1);
+  return dss_resize(s, len);
+}
+
+/* Shrinks the buffer only once the unused capacity exceeds the configured
+ * share of it. Small edits then don't pay for a realloc each, and a string
+ * that just doubled isn't shrunk straight back. */
+dss dss_shrink(dss s) {
+  size_t cap = dss_getcap(s);
+  size_t slack = cap - dss_getlen(s);
+  if ((double)slack * 100 <= (double)cap * dss_shrink_slack)
+    return s;
+  return dss_shrink_to_fit(s);
+}
+
+/* Sets the percentage of the capacity that has to be unused before
+ * dss_shrink and dss_trim reallocate. 0 shrinks on any slack, 100 or more
+ * never. */
+void dss_set_shrink_slack(unsigned percent) { dss_shrink_slack = percent; }
+
+/*Use to append any formatted string to the dss string. It accepts concat_func
+ * as one of the parameters. You can use dss_concat or dss_concat or
+ * dss_concatcow letting you choose the way of concatenation.
+ *
+ * Both of them format directly into the string through dss_catvprintf,
+ * dss_concatcow copying a shared string first. Other functions receive the
+ * formatted bytes in a temporary buffer. When vsnprintf fails the string is
+ * returned unchanged with errno set; NULL means an allocation failed.
+ */
+dss dss_catprintf(dss s, dss (*concat_func)(dss, const char *), const char *fmt,
+                  ...) {
+  va_list ap, cp;
+  va_start(ap, fmt);
+
+  if (concat_func == dss_concatcow && dss_ref_load(s) > 1) {
+    /*Measure the output first so the copy is made once, at its final
+     * size*/
+    va_copy(cp, ap);
+    int tb = dss_vsnprintf(NULL, 0, fmt, cp);
+    va_end(cp);
+    if (tb >= 0) {
+      s = dss_unshare_reserve(s, tb);
+      if (s)
+        s = dss_catvprintf(s, fmt, ap);
+    }
+    va_end(ap);
+    return s;
+  }
+
+  if (concat_func == dss_concat || concat_func == dss_concatcow) {
+    s = dss_catvprintf(s, fmt, ap);
+    va_end(ap);
+    return s;
+  }
+
+  va_copy(cp, ap);
+  /*find the total bytes needed in fmt string*/
+  int tb = dss_vsnprintf(NULL, 0, fmt, cp);
+  va_end(cp);
+  if (tb < 0) {
+    va_end(ap);
+    return s;
+  }
+  char *temp = dss_malloc((size_t)tb + DSS_NULLT);
+  if (!temp) {
+    fprintf(stderr, "Not able to allocate memory.");
+    va_end(ap);
+    return NULL;
+  }
+  vsnprintf(temp, (size_t)tb + DSS_NULLT, fmt, ap);
+  /*Expand memory for 'tb' bytes if needed is handled internally in
+   * concat_func*/
+  s = concat_func(s, temp);
+  dss_dealloc(temp);
+  va_end(ap);
+  return s;
+}
+
+/* Clamps the range of dss_trim to the string. Returns the number of bytes
+ * kept and stores the offset of the first one in 'from'. */
+static size_t dss_trim_range(const dss s, int start, int end, size_t *from) {
+  uint64_t slen = dss_getlen(s) - DSS_NULLT;
+
+  if (start < 0)
+    start = slen + start;
+  if (end < 0)
+    end = slen + end;
+
+  if (start < 0)
+    start = 0;
+  if ((uint64_t)start > slen)
+    start = slen;
+  if (end >= (int)slen)
+    end = slen - 1;
+  if (end < start)
+    end = start - 1;
+
+  *from = start;
+  return end - start + DSS_NULLT;
+}
+
+/*Returns a trimmed string between start and end. The buffer is shrunk to
+ * fit the trimmed bytes only once the unused share of it passes the slack
+ * set with dss_set_shrink_slack, see dss_shrink.*/
+dss dss_trim(dss s, int start, int end) {
+  size_t from;
+  s = dss_plain(s);
+  if (!s)
+    return NULL;
+  uint64_t new_len = dss_trim_range(s, start, end, &from);
+
+  memmove(s, s + from, new_len);
+  s[new_len] = '\0';
+  dss_setlen(s, new_len + DSS_NULLT);
+
+  /*Reallocate to shrink the buffer once enough of it is unused. This may
+   * also move the string behind a smaller header class.*/
+  return dss_shrink(s);
+}
+
+/* Copy-on-write version of dss_trim. Only the kept bytes of a shared string
+ * are copied, into a buffer that fits them. */
+dss dss_trimcow(dss s, int start, int end) {
+  s = dss_plain(s);
+  if (!s)
+    return NULL;
+  if (dss_ref_load(s) <= 1)
+    return dss_trim(s, start, end);
+  size_t from;
+  size_t n = dss_trim_range(s, start, end, &from);
+  dss ns = dss_cow_copy(s, from, n, 0);
+  if (!ns)
+    return NULL;
+  dss_free(s);
+  return ns;
+}
+
+/* Sets the growth policy used by every string that has no policy of its
+ * own. DSS_GROWTH_DEFAULT is not a valid argument here and is ignored. */
+void dss_set_default_growth(dss_growth_policy policy) {
+  if (policy == DSS_GROWTH_DEFAULT || policy > DSS_GROWTH_EXACT)
+    return;
+  dss_default_growth = policy;
+}
+
+dss_growth_policy dss_get_default_growth(void) { return dss_default_growth; }
+
+/* Configures DSS_GROWTH_CAPPED: buffers double until 'threshold' bytes and
+ * then grow by 'step' bytes at a time. */
+void dss_set_growth_step(size_t threshold, size_t step) {
+  dss_growth_threshold = threshold;
+  dss_growth_step = step;
+}
+
+/* Overrides the growth policy of a single string. Pass DSS_GROWTH_DEFAULT to
+ * make the string follow the global default again. The policy is kept in the
+ * header so it travels with the string through reallocations and dss_dup. */
+void dss_set_growth_policy(dss s, dss_growth_policy policy) {
+  if (policy > DSS_GROWTH_EXACT)
+    return;
+  DSS_FLAGS(s) = (DSS_FLAGS(s) & ~DSS_FLAG_GROWTH_MASK) | (uint8_t)policy;
+}
+
+dss_growth_policy dss_get_growth_policy(const dss s) {
+  return (dss_growth_policy)(DSS_FLAGS(s) & DSS_FLAG_GROWTH_MASK);
+}
+
+/* Makes the reference count of a single string thread safe (or plain again
+ * when 'enable' is 0). Set it before the string is shared with other
+ * threads. Building with DSS_ATOMIC_REFCOUNT defined turns it on for every
+ * string. */
+void dss_set_atomic_refcount(dss s, int enable) {
+  if (enable)
+    DSS_FLAGS(s) |= DSS_FLAG_ATOMIC;
+  else
+    DSS_FLAGS(s) &= ~DSS_FLAG_ATOMIC;
+}
+
+/* Arena allocation. Strings are bump allocated from large blocks and all of
+ * them are released together by dss_arena_reset or dss_arena_destroy.
+ * Requests larger than the block size get a block of their own. */
+
+/* Headers are aligned so that ref_count can be updated atomically */
+#define DSS_ARENA_ALIGN 8
+
+typedef struct dss_arena_block {
+  struct dss_arena_block *next;
+  size_t size;
+  size_t used;
+  char data[];
+} dss_arena_block;
+
+struct dss_arena {
+  /* Block bump allocations are served from */
+  dss_arena_block *head;
+  /* First block ever allocated, the one dss_arena_reset keeps. Blocks of
+   * oversized requests may be linked after it. */
+  dss_arena_block *first;
+  size_t block_size;
+  /* Most recent allocation, the only one that can be extended in place */
+  void *last;
+};
+
+static dss_arena_block *dss_arena_block_new(size_t size) {
+  dss_arena_block *b = dss_malloc(sizeof(dss_arena_block) + size);
+  if (!b) {
+    fprintf(stderr, "Not able to allocate memory.");
+    return NULL;
+  }
+  b->next = NULL;
+  b->size = size;
+  b->used = 0;
+  return b;
+}
+
+dss_arena *dss_arena_new(size_t block_size) {
+  if (block_size == 0)
+    block_size = DSS_ARENA_BLOCK_SIZE;
+  dss_arena *a = dss_malloc(sizeof(dss_arena));
+  if (!a) {
+    fprintf(stderr, "Not able to allocate memory.");
+    return NULL;
+  }
+  a->block_size = block_size;
+  a->last = NULL;
+  a->head = a->first = dss_arena_block_new(block_size);
+  if (!a->head) {
+    dss_dealloc(a);
+    return NULL;
+  }
+  return a;
+}
+
+static void *dss_arena_alloc(dss_arena *a, size_t size) {
+  dss_arena_block *b = a->head;
+  size_t off = (b->used + DSS_ARENA_ALIGN - 1) & ~(size_t)(DSS_ARENA_ALIGN - 1);
+
+  if (off + size <= b->size) {
+    b->used = off + size;
+    a->last = b->data + off;
+    return a->last;
+  }
+
+  if (size > a->block_size / 2) {
+    /* Too big to share a block. It goes behind the current block so the
+     * free space left in there is not lost. */
+    dss_arena_block *big = dss_arena_block_new(size);
+    if (!big)
+      return NULL;
+    big->used = size;
+    big->next = b->next;
+    b->next = big;
+    return big->data;
+  }
+
+  dss_arena_block *nb = dss_arena_block_new(a->block_size);
+  if (!nb)
+    return NULL;
+  nb->next = b;
+  nb->used = size;
+  a->head = nb;
+  a->last = nb->data;
+  return nb->data;
+}
+
+/* Extends the most recent allocation in place by 'extra' bytes if the
+ * current block has room for it. */
+static int dss_arena_extend(dss_arena *a, void *p, size_t extra) {
+  dss_arena_block *b = a->head;
+  if (p != a->last || b->size - b->used < extra)
+    return 0;
+  b->used += extra;
+  return 1;
+}
+
+/* Gives back every string allocated from the arena. Only the first block is
+ * kept for reuse. */
+void dss_arena_reset(dss_arena *a) {
+  dss_arena_block *b = a->head;
+  while (b) {
+    dss_arena_block *next = b->next;
+    if (b != a->first)
+      dss_dealloc(b);
+    b = next;
+  }
+  b = a->first;
+  b->next = NULL;
+  b->used = 0;
+  a->head = b;
+  a->last = NULL;
+}
+
+void dss_arena_destroy(dss_arena *a) {
+  if (a == NULL)
+    return;
+  dss_arena_reset(a);
+  dss_dealloc(a->head);
+  dss_dealloc(a);
+}
+
+/* Allocates an arena string with room for 'cap' bytes in buf */
+static dss dss_arena_hdr(dss_arena *a, size_t cap) {
+  int type = dss_req_type(cap);
+  void *sh = dss_arena_alloc(a, dss_hdr_size(type) + cap);
+  if (!sh)
+    return NULL;
+  dss s = dss_hdr_init(sh, type, cap);
+  DSS_FLAGS(s) |= DSS_FLAG_ARENA;
+  return s;
+}
+
+dss dss_new_arena(dss_arena *a, const char *t) {
+  return dss_newb_arena(a, t, strlen(t));
+}
+
+dss dss_newb_arena(dss_arena *a, const void *t, size_t len) {
+  dss s = dss_arena_hdr(a, len + DSS_NULLT);
+  if (!s)
+    return NULL;
+  memcpy(s, t, len);
+  s[len] = '\0';
+  dss_setlen(s, len + DSS_NULLT);
+  return s;
+}
+
+dss dss_empty_arena(dss_arena *a) { return dss_newb_arena(a, "", 0); }
+
+/* Copies any dss string into the arena, a compressed one decompressed */
+dss dss_dup_arena(dss_arena *a, const dss s) {
+  dss p = dss_readable(s);
+  if (!p)
+    return NULL;
+  dss ds = dss_newb_arena(a, p, dss_getlen(p) - DSS_NULLT);
+  dss_readable_done(s, p);
+  return ds;
+}
+
+dss dss_concat_arena(dss_arena *a, dss s, const char *t) {
+  return dss_concatb_arena(a, s, t, strlen(t));
+}
+
+/* Appends to a string of the arena. When the string is the last allocation
+ * of the arena, its buffer is extended in place. Otherwise a bigger copy is
+ * allocated from the arena following the growth policy of the string.
+ * Strings that don't belong to an arena are handled by dss_concatb. */
+dss dss_concatb_arena(dss_arena *a, dss s, const void *t, size_t len) {
+  if (!(DSS_FLAGS(s) & DSS_FLAG_ARENA))
+    return dss_concatb(s, t, len);
+  if (len == 0)
+    return s;
+
+  size_t curlen = dss_getlen(s);
+  size_t needed = curlen + len;
+  size_t total = dss_getcap(s);
+
+  if (needed > total) {
+    size_t new_cap = dss_next_cap(dss_hdr_growth(s), total, needed);
+    if (dss_req_type(new_cap) == DSS_TYPE(s) &&
+        dss_arena_extend(a, dss_hdr_start(s), new_cap - total)) {
+      dss_setcap(s, new_cap);
+    } else {
+      dss ns = dss_arena_hdr(a, new_cap);
+      if (!ns)
+        return NULL;
+      memcpy(ns, s, curlen);
+      dss_setlen(ns, curlen);
+      dss_copy_meta(ns, s);
+      s = ns;
+    }
+  }
+
+  return dss_append_utf8(s, t, len);
+}
+
+/* Routes every heap allocation made by dss through 'a'. usable_size_fn may
+ * be NULL when the allocator can't report the real size of a block. Passing
+ * NULL restores the libc allocator. Strings must be freed by the allocator
+ * that created them, so call this before any string is allocated. */
+void dss_set_allocator(const dss_allocator *a) {
+  if (a == NULL) {
+    dss_allocator libc = {malloc, realloc, free, DSS_LIBC_USABLE_SIZE};
+    dss_mem = libc;
+    return;
+  }
+  dss_mem = *a;
+}
+
+/* Number formatting. The appenders below write their digits straight into
+ * the tail of the string after reserving the maximum room they can need, so
+ * no temporary buffer nor stdio is involved. */
+
+/* Widest output of a 64-bit integer, sign included */
+#define DSS_INT_MAXLEN 20
+/* Widest output of dss_catdouble in shortest mode, e.g.
+ * "-2.2250738585072014e-308" */
+#define DSS_DOUBLE_MAXLEN 32
+/* Widest output of dss_catdouble with a precision: a sign, the 20 digits
+ * of a 64-bit integer and the decimal point */
+#define DSS_FIXED_MAXLEN 22
+
+static const char dss_digit_pairs[] = "00010203040506070809"
+                                      "10111213141516171819"
+                                      "20212223242526272829"
+                                      "30313233343536373839"
+                                      "40414243444546474849"
+                                      "50515253545556575859"
+                                      "60616263646566676869"
+                                      "70717273747576777879"
+                                      "80818283848586878889"
+                                      "90919293949596979899";
+
+static inline int dss_u64_digits(uint64_t v) {
+  int n = 1;
+  for (;;) {
+    if (v < 10)
+      return n;
+    if (v < 100)
+      return n + 1;
+    if (v < 1000)
+      return n + 2;
+    if (v < 10000)
+      return n + 3;
+    v /= 10000;
+    n += 4;
+  }
+}
+
+/* Writes the 'n' decimal digits of 'v' to dst, two at a time from the
+ * right end. */
+static inline void dss_u64_write(char *dst, uint64_t v, int n) {
+  char *p = dst + n;
+  while (v >= 100) {
+    unsigned i = (unsigned)(v % 100) * 2;
+    v /= 100;
+    *--p = dss_digit_pairs[i + 1];
+    *--p = dss_digit_pairs[i];
+  }
+  if (v < 10) {
+    *--p = (char)('0' + v);
+  } else {
+    unsigned i = (unsigned)v * 2;
+    *--p = dss_digit_pairs[i + 1];
+    *--p = dss_digit_pairs[i];
+  }
+}
+
+/* Writes 'v' to dst and returns the number of bytes written */
+static inline size_t dss_i64_write(char *dst, int64_t v) {
+  size_t n = 0;
+  uint64_t u = (uint64_t)v;
+  if (v < 0) {
+    dst[n++] = '-';
+    u = 0 - u;
+  }
+  int digits = dss_u64_digits(u);
+  dss_u64_write(dst + n, u, digits);
+  return n + digits;
+}
+
+/* Commits 'n' bytes that were written at the current null term */
+static inline dss dss_commit_tail(dss s, size_t n) {
+  size_t len = dss_getlen(s) + n;
+  dss_setlen(s, len);
+  s[len - DSS_NULLT] = '\0';
+  return s;
+}
+
+dss dss_catint(dss s, long long v) {
+  s = dss_expand(s, DSS_INT_MAXLEN);
+  if (!s)
+    return NULL;
+  size_t n = dss_i64_write(s + dss_getlen(s) - DSS_NULLT, v);
+  return dss_commit_tail(s, n);
+}
+
+dss dss_catuint(dss s, unsigned long long v) {
+  s = dss_expand(s, DSS_INT_MAXLEN);
+  if (!s)
+    return NULL;
+  int n = dss_u64_digits(v);
+  dss_u64_write(s + dss_getlen(s) - DSS_NULLT, v, n);
+  return dss_commit_tail(s, n);
+}
+
+/* Shortest round-trip conversion of doubles with the Grisu2 algorithm by
+ * Florian Loitsch ("Printing Floating-Point Numbers Quickly and Accurately
+ * with Integers"), following the layout of Milo Yip's implementation. The
+ * printed digits always parse back to the same double and are the shortest
+ * such digits in nearly every case. */
+
+typedef struct {
+  uint64_t f;
+  int e;
+} dss_diyfp;
+
+#define DSS_DP_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+#define DSS_DP_HIDDEN_BIT 0x0010000000000000ULL
+#define DSS_DP_SIGNIFICAND_SIZE 52
+#define DSS_DP_EXPONENT_BIAS (0x3FF + DSS_DP_SIGNIFICAND_SIZE)
+
+/* Normalized 64-bit significands and binary exponents of 10^k for
+ * k = -348, -340, ..., 340 */
+static const uint64_t dss_pow10_f[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+    0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+    0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+    0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+    0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+    0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+    0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+    0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+    0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+    0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+    0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+    0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+    0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+    0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+    0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+    0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+    0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+    0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+    0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+    0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+    0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+    0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL};
+
+static const int16_t dss_pow10_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954,
+    -927, -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635,
+    -608, -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316,
+    -289, -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30, 56,
+    83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348, 375, 402, 428, 455,
+    481, 508, 534, 561, 588, 614, 641, 667, 694, 720, 747, 774, 800, 827, 853,
+    880, 907, 933, 960, 986, 1013, 1039, 1066};
+
+static inline dss_diyfp dss_diyfp_make(double d) {
+  uint64_t u;
+  memcpy(&u, &d, sizeof(u));
+  int biased_e = (int)((u >> DSS_DP_SIGNIFICAND_SIZE) & 0x7FF);
+  uint64_t significand = u & DSS_DP_SIGNIFICAND_MASK;
+  dss_diyfp r;
+  if (biased_e != 0) {
+    r.f = significand + DSS_DP_HIDDEN_BIT;
+    r.e = biased_e - DSS_DP_EXPONENT_BIAS;
+  } else {
+    r.f = significand;
+    r.e = 1 - DSS_DP_EXPONENT_BIAS;
+  }
+  return r;
+}
+
+/* Product of two diyfp, rounded to the upper 64 bits */
+static inline dss_diyfp dss_diyfp_mul(dss_diyfp x, dss_diyfp y) {
+  const uint64_t m32 = 0xFFFFFFFFULL;
+  uint64_t a = x.f >> 32, b = x.f & m32, c = y.f >> 32, d = y.f & m32;
+  uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  uint64_t tmp = (bd >> 32) + (ad & m32) + (bc & m32);
+  tmp += 1ULL << 31;
+  dss_diyfp r = {ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64};
+  return r;
+}
+
+static inline dss_diyfp dss_diyfp_normalize(dss_diyfp x) {
+  int s = __builtin_clzll(x.f);
+  x.f <<= s;
+  x.e -= s;
+  return x;
+}
+
+/* Boundaries m- and m+ of the interval of reals that round to 'v' */
+static inline void dss_diyfp_boundaries(dss_diyfp v, dss_diyfp *minus,
+                                        dss_diyfp *plus) {
+  dss_diyfp pl = {(v.f << 1) + 1, v.e - 1};
+  while (!(pl.f & (DSS_DP_HIDDEN_BIT << 1))) {
+    pl.f <<= 1;
+    pl.e--;
+  }
+  pl.f <<= 64 - DSS_DP_SIGNIFICAND_SIZE - 2;
+  pl.e -= 64 - DSS_DP_SIGNIFICAND_SIZE - 2;
+
+  dss_diyfp mi;
+  if (v.f == DSS_DP_HIDDEN_BIT) {
+    mi.f = (v.f << 2) - 1;
+    mi.e = v.e - 2;
+  } else {
+    mi.f = (v.f << 1) - 1;
+    mi.e = v.e - 1;
+  }
+  mi.f <<= mi.e - pl.e;
+  mi.e = pl.e;
+  *minus = mi;
+  *plus = pl;
+}
+
+/* Cached power c = 10^-K such that the product with a diyfp of binary
+ * exponent 'e' lands in the exponent range DigitGen works with */
+static inline dss_diyfp dss_cached_power(int e, int *K) {
+  double dk = (-61 - e) * 0.30102999566398114 + 347;
+  int k = (int)dk;
+  if (dk - k > 0.0)
+    k++;
+  unsigned index = (unsigned)((k >> 3) + 1);
+  *K = -(-348 + (int)(index << 3));
+  dss_diyfp r = {dss_pow10_f[index], dss_pow10_e[index]};
+  return r;
+}
+
+static inline void dss_grisu_round(char *buf, int len, uint64_t delta,
+                                   uint64_t rest, uint64_t ten_kappa,
+                                   uint64_t wp_w) {
+  while (rest < wp_w && delta - rest >= ten_kappa &&
+         (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+    buf[len - 1]--;
+    rest += ten_kappa;
+  }
+}
+
+static const uint64_t dss_pow10[] = {1ULL,
+                                     10ULL,
+                                     100ULL,
+                                     1000ULL,
+                                     10000ULL,
+                                     100000ULL,
+                                     1000000ULL,
+                                     10000000ULL,
+                                     100000000ULL,
+                                     1000000000ULL,
+                                     10000000000ULL,
+                                     100000000000ULL,
+                                     1000000000000ULL,
+                                     10000000000000ULL,
+                                     100000000000000ULL,
+                                     1000000000000000ULL,
+                                     10000000000000000ULL,
+                                     100000000000000000ULL,
+                                     1000000000000000000ULL,
+                                     10000000000000000000ULL};
+
+static void dss_grisu_digits(dss_diyfp w, dss_diyfp mp, uint64_t delta,
+                             char *buf, int *len, int *K) {
+  dss_diyfp one = {1ULL << -mp.e, mp.e};
+  uint64_t wp_w = mp.f - w.f;
+  uint32_t p1 = (uint32_t)(mp.f >> -one.e);
+  uint64_t p2 = mp.f & (one.f - 1);
+  int kappa = dss_u64_digits(p1);
+  *len = 0;
+
+  while (kappa > 0) {
+    uint32_t d = (uint32_t)(p1 / dss_pow10[kappa - 1]);
+    p1 %= (uint32_t)dss_pow10[kappa - 1];
+    if (d || *len)
+      buf[(*len)++] = (char)('0' + d);
+    kappa--;
+    uint64_t tmp = ((uint64_t)p1 << -one.e) + p2;
+    if (tmp <= delta) {
+      *K += kappa;
+      dss_grisu_round(buf, *len, delta, tmp, dss_pow10[kappa] << -one.e,
+                      wp_w);
+      return;
+    }
+  }
+
+  for (;;) {
+    p2 *= 10;
+    delta *= 10;
+    char d = (char)(p2 >> -one.e);
+    if (d || *len)
+      buf[(*len)++] = (char)('0' + d);
+    p2 &= one.f - 1;
+    kappa--;
+    if (p2 < delta) {
+      *K += kappa;
+      int index = -kappa;
+      dss_grisu_round(buf, *len, delta, p2, one.f,
+                      wp_w * (index < 20 ? dss_pow10[index] : 0));
+      return;
+    }
+  }
+}
+
+/* Digits of a positive, finite 'value' such that value = digits * 10^K */
+static void dss_grisu2(double value, char *buf, int *len, int *K) {
+  dss_diyfp v = dss_diyfp_make(value);
+  dss_diyfp w_m, w_p;
+  dss_diyfp_boundaries(v, &w_m, &w_p);
+
+  dss_diyfp c_mk = dss_cached_power(w_p.e, K);
+  dss_diyfp w = dss_diyfp_mul(dss_diyfp_normalize(v), c_mk);
+  dss_diyfp wp = dss_diyfp_mul(w_p, c_mk);
+  dss_diyfp wm = dss_diyfp_mul(w_m, c_mk);
+  wm.f++;
+  wp.f--;
+  dss_grisu_digits(w, wp, wp.f - wm.f, buf, len, K);
+}
+
+/* Lays out 'len' digits with decimal exponent 'k' in buf, using plain
+ * notation for exponents in [-6, 21) like printf's %g does and scientific
+ * notation otherwise. Returns the new length. */
+static int dss_prettify(char *buf, int len, int k) {
+  int kk = len + k; /* 10^(kk-1) <= v < 10^kk */
+
+  if (k >= 0 && kk <= 21) {
+    /* 1234e7 -> 12340000000 */
+    memset(buf + len, '0', k);
+    return kk;
+  }
+  if (kk > 0 && kk <= 21) {
+    /* 1234e-2 -> 12.34 */
+    memmove(buf + kk + 1, buf + kk, len - kk);
+    buf[kk] = '.';
+    return len + 1;
+  }
+  if (kk > -6 && kk <= 0) {
+    /* 1234e-6 -> 0.001234 */
+    int offset = 2 - kk;
+    memmove(buf + offset, buf, len);
+    buf[0] = '0';
+    buf[1] = '.';
+    memset(buf + 2, '0', offset - 2);
+    return len + offset;
+  }
+
+  /* 1234e30 -> 1.234e+33 */
+  int n = 1;
+  if (len > 1) {
+    memmove(buf + 2, buf + 1, len - 1);
+    buf[1] = '.';
+    n = len + 1;
+  }
+  int exp = kk - 1;
+  buf[n++] = 'e';
+  buf[n++] = exp < 0 ? '-' : '+';
+  if (exp < 0)
+    exp = -exp;
+  int digits = dss_u64_digits((uint64_t)exp);
+  dss_u64_write(buf + n, (uint64_t)exp, digits);
+  return n + digits;
+}
+
+/* Writes the shortest representation of 'v' that parses back to the same
+ * double and returns its length. */
+static size_t dss_double_write(char *dst, double v) {
+  size_t n = 0;
+  if (v != v) {
+    memcpy(dst, "nan", 3);
+    return 3;
+  }
+  if (signbit(v)) {
+    dst[n++] = '-';
+    v = -v;
+  }
+  if (isinf(v)) {
+    memcpy(dst + n, "inf", 3);
+    return n + 3;
+  }
+  if (v == 0.0) {
+    dst[n] = '0';
+    return n + 1;
+  }
+  int len, K;
+  dss_grisu2(v, dst + n, &len, &K);
+  return n + dss_prettify(dst + n, len, K);
+}
+
+/* Fixed precision. round(|v| * 10^precision) is computed exactly in 128
+ * bits from the binary value of 'v', a tie going to the even neighbour, so
+ * the digits are the ones glibc's "%.*f" prints in the default rounding
+ * mode. Returns 0, leaving 'v' to printf, when the result doesn't fit 64
+ * bits, for nan and inf, and on targets without 128-bit integers. */
+static int dss_fixed_scale(double v, int precision, uint64_t *q) {
+#ifdef __SIZEOF_INT128__
+  if (precision > 19 || !isfinite(v))
+    return 0;
+  dss_diyfp d = dss_diyfp_make(fabs(v));
+  __uint128_t r = (__uint128_t)d.f * dss_pow10[precision];
+  if (d.e >= 0) {
+    /* An integer, nothing to round */
+    if (d.e >= 64 || (r >> (64 - d.e)) != 0)
+      return 0;
+    *q = (uint64_t)(r << d.e);
+    return 1;
+  }
+  int sh = -d.e;
+  /* r is below 2^117, less than half of 2^sh */
+  if (sh >= 128) {
+    *q = 0;
+    return 1;
+  }
+  __uint128_t quo = r >> sh, rem = r - (quo << sh);
+  __uint128_t half = (__uint128_t)1 << (sh - 1);
+  if (rem > half || (rem == half && (quo & 1)))
+    quo++;
+  if (quo >> 64)
+    return 0;
+  *q = (uint64_t)quo;
+  return 1;
+#else
+  (void)v;
+  (void)precision;
+  (void)q;
+  return 0;
+#endif
+}
+
+/* Writes 'q' / 10^precision with 'precision' decimals, negative if 'neg',
+ * and returns the length */
+static size_t dss_fixed_write(char *dst, int neg, uint64_t q, int precision) {
+  size_t n = 0;
+  if (neg)
+    dst[n++] = '-';
+  uint64_t ip = q / dss_pow10[precision], fp = q % dss_pow10[precision];
+  int digits = dss_u64_digits(ip);
+  dss_u64_write(dst + n, ip, digits);
+  n += digits;
+  if (precision) {
+    dst[n++] = '.';
+    digits = dss_u64_digits(fp);
+    memset(dst + n, '0', precision - digits);
+    dss_u64_write(dst + n + precision - digits, fp, digits);
+    n += precision;
+  }
+  return n;
+}
+
+/* Appends 'v' in decimal. A negative 'precision' gives the shortest digits
+ * that round-trip, otherwise 'precision' digits are printed after the
+ * decimal point like "%.*f" does. Precisions above 19 and values too large
+ * for them to be scaled in 64 bits go through vsnprintf. */
+dss dss_catdouble(dss s, double v, int precision) {
+  uint64_t q;
+  if (precision >= 0) {
+    if (!dss_fixed_scale(v, precision, &q))
+      return dss_catprintf(s, dss_concat, "%.*f", precision, v);
+    s = dss_expand(s, DSS_FIXED_MAXLEN);
+    if (!s)
+      return NULL;
+    size_t n = dss_fixed_write(s + dss_getlen(s) - DSS_NULLT,
+                               signbit(v) != 0, q, precision);
+    return dss_commit_tail(s, n);
+  }
+
+  s = dss_expand(s, DSS_DOUBLE_MAXLEN);
+  if (!s)
+    return NULL;
+  size_t n = dss_double_write(s + dss_getlen(s) - DSS_NULLT, v);
+  return dss_commit_tail(s, n);
+}
+
+/* A much faster but restricted printf that never touches stdio. It knows
+ * about these directives only:
+ *
+ *  %s - C string
+ *  %S - dss string
+ *  %i - signed int
+ *  %I - 64 bit signed integer (long long, int64_t)
+ *  %u - unsigned int
+ *  %U - 64 bit unsigned integer (unsigned long long, uint64_t)
+ *  %% - verbatim "%" character
+ *
+ * Any other character following '%' is appended as is. The string is
+ * mutated like with dss_concat. Since it may already have moved when an
+ * allocation fails, the string is freed in that case and NULL returned.
+ */
+dss dss_catfmt(dss s, const char *fmt, ...) {
+  va_list ap;
+  const char *f = fmt;
+  va_start(ap, fmt);
+
+  while (*f && s) {
+    if (*f != '%') {
+      const char *run = f;
+      while (*f && *f != '%')
+        f++;
+      dss ns = dss_concatb(s, run, f - run);
+      if (!ns)
+        dss_free(s);
+      s = ns;
+      continue;
+    }
+
+    dss ns;
+    f++;
+    switch (*f) {
+    case 's': {
+      const char *str = va_arg(ap, const char *);
+      ns = dss_concatb(s, str, strlen(str));
+      break;
+    }
+    case 'S': {
+      dss str = va_arg(ap, dss);
+      ns = dss_concatb(s, str, dss_getlen(str) - DSS_NULLT);
+      break;
+    }
+    case 'i':
+      ns = dss_catint(s, va_arg(ap, int));
+      break;
+    case 'I':
+      ns = dss_catint(s, va_arg(ap, long long));
+      break;
+    case 'u':
+      ns = dss_catuint(s, va_arg(ap, unsigned int));
+      break;
+    case 'U':
+      ns = dss_catuint(s, va_arg(ap, unsigned long long));
+      break;
+    case '\0':
+      ns = s;
+      break;
+    default:
+      ns = dss_concatb(s, f, 1);
+      break;
+    }
+    if (*f)
+      f++;
+    if (!ns)
+      dss_free(s);
+    s = ns;
+  }
+
+  va_end(ap);
+  return s;
+}
+
+/* Builders. A builder collects appended bytes in a buffer supplied by the
+ * caller, usually on the stack, and only moves them to the heap when they
+ * outgrow it. dss_builder_finish then copies them into a string allocated
+ * once, at its final size. */
+
+void dss_builder_init(dss_builder *b, void *buf, size_t size) {
+  b->buf = b->stack = buf;
+  b->len = 0;
+  b->cap = b->stack_size = size;
+}
+
+/* Makes room for 'n' more bytes. Returns 0, or -1 when the buffer can't be
+ * moved to or grown on the heap, in which case the builder is unchanged. */
+static int dss_builder_room(dss_builder *b, size_t n) {
+  if (b->cap - b->len >= n)
+    return 0;
+  size_t cap = b->cap * 2;
+  if (cap < b->len + n)
+    cap = b->len + n;
+  char *buf;
+  if (b->buf != b->stack) {
+    buf = dss_realloc(b->buf, cap);
+  } else {
+    buf = dss_malloc(cap);
+    if (buf && b->len)
+      memcpy(buf, b->buf, b->len);
+  }
+  if (!buf) {
+    fprintf(stderr, "Not able to allocate memory.");
+    return -1;
+  }
+  b->buf = buf;
+  b->cap = cap;
+  return 0;
+}
+
+int dss_builder_concatb(dss_builder *b, const void *t, size_t len) {
+  if (dss_builder_room(b, len) < 0)
+    return -1;
+  memcpy(b->buf + b->len, t, len);
+  b->len += len;
+  return 0;
+}
+
+int dss_builder_concat(dss_builder *b, const char *t) {
+  return dss_builder_concatb(b, t, strlen(t));
+}
+
+/* Formats into the free room of the builder, like dss_catvprintf */
+int dss_builder_catvprintf(dss_builder *b, const char *fmt, va_list ap) {
+  va_list cp;
+  size_t room = b->cap - b->len;
+
+  /* Growing would move bytes an argument points to */
+  if (dss_fmt_aliases(fmt, ap, b->buf, b->buf + b->cap)) {
+    char stack[DSS_PRINTF_STACK];
+    int tb;
+    char *buf = dss_format_temp(stack, sizeof(stack), &tb, fmt, ap);
+    if (!buf)
+      return -1;
+    int r = dss_builder_concatb(b, buf, tb);
+    if (buf != stack)
+      dss_dealloc(buf);
+    return r;
+  }
+
+  va_copy(cp, ap);
+  int tb = dss_vsnprintf(room ? b->buf + b->len : NULL, room, fmt, cp);
+  va_end(cp);
+  if (tb < 0)
+    return -1;
+  if ((size_t)tb >= room) {
+    /* vsnprintf needs room for a null term, finish adds its own */
+    if (dss_builder_room(b, (size_t)tb + DSS_NULLT) < 0)
+      return -1;
+    va_copy(cp, ap);
+    vsnprintf(b->buf + b->len, (size_t)tb + DSS_NULLT, fmt, cp);
+    va_end(cp);
+  }
+  b->len += tb;
+  return 0;
+}
+
+int dss_builder_catprintf(dss_builder *b, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int r = dss_builder_catvprintf(b, fmt, ap);
+  va_end(ap);
+  return r;
+}
+
+int dss_builder_catint(dss_builder *b, long long v) {
+  if (dss_builder_room(b, DSS_INT_MAXLEN) < 0)
+    return -1;
+  b->len += dss_i64_write(b->buf + b->len, v);
+  return 0;
+}
+
+int dss_builder_catuint(dss_builder *b, unsigned long long v) {
+  if (dss_builder_room(b, DSS_INT_MAXLEN) < 0)
+    return -1;
+  int n = dss_u64_digits(v);
+  dss_u64_write(b->buf + b->len, v, n);
+  b->len += n;
+  return 0;
+}
+
+/* Appends 'v' like dss_catdouble */
+int dss_builder_catdouble(dss_builder *b, double v, int precision) {
+  uint64_t q;
+  if (precision >= 0) {
+    if (!dss_fixed_scale(v, precision, &q))
+      return dss_builder_catprintf(b, "%.*f", precision, v);
+    if (dss_builder_room(b, DSS_FIXED_MAXLEN) < 0)
+      return -1;
+    b->len += dss_fixed_write(b->buf + b->len, signbit(v) != 0, q, precision);
+    return 0;
+  }
+  if (dss_builder_room(b, DSS_DOUBLE_MAXLEN) < 0)
+    return -1;
+  b->len += dss_double_write(b->buf + b->len, v);
+  return 0;
+}
+
+/* Drops the bytes of the builder and gives back its heap buffer, leaving it
+ * as dss_builder_init did. */
+void dss_builder_reset(dss_builder *b) {
+  if (b->buf != b->stack)
+    dss_dealloc(b->buf);
+  dss_builder_init(b, b->stack, b->stack_size);
+}
+
+/* Returns the bytes of the builder as a new dss string, allocated once for
+ * exactly its length, and resets the builder. Returns NULL and keeps the
+ * bytes when the string can't be allocated. */
+dss dss_builder_finish(dss_builder *b) {
+  dss s = dss_alloc(b->len + DSS_NULLT);
+  if (!s)
+    return NULL;
+  if (b->len)
+    memcpy(s, b->buf, b->len);
+  s[b->len] = '\0';
+  dss_setlen(s, b->len + DSS_NULLT);
+  dss_builder_reset(b);
+  return s;
+}
+
+/* Ropes. Data appended to a rope is copied once into a list of fixed size
+ * chunks and never moved again, so building a huge buffer never holds an
+ * old and a new copy at the same time. */
+
+typedef struct dss_rope_chunk {
+  struct dss_rope_chunk *next;
+  /* Bytes used in data */
+  size_t len;
+  char data[];
+} dss_rope_chunk;
+
+struct dss_rope {
+  dss_rope_chunk *head;
+  dss_rope_chunk *tail;
+  size_t chunk_size;
+  size_t nchunks;
+  /* Total bytes appended to the rope */
+  size_t len;
+};
+
+dss_rope *dss_rope_new(size_t chunk_size) {
+  if (chunk_size == 0)
+    chunk_size = DSS_ROPE_CHUNK_SIZE;
+  dss_rope *r = dss_malloc(sizeof(dss_rope));
+  if (!r) {
+    fprintf(stderr, "Not able to allocate memory.");
+    return NULL;
+  }
+  r->head = r->tail = NULL;
+  r->chunk_size = chunk_size;
+  r->nchunks = 0;
+  r->len = 0;
+  return r;
+}
+
+static void dss_rope_clear(dss_rope *r) {
+  dss_rope_chunk *c = r->head;
+  while (c) {
+    dss_rope_chunk *next = c->next;
+    dss_dealloc(c);
+    c = next;
+  }
+  r->head = r->tail = NULL;
+  r->nchunks = 0;
+  r->len = 0;
+}
+
+void dss_rope_free(dss_rope *r) {
+  if (r == NULL)
+    return;
+  dss_rope_clear(r);
+  dss_dealloc(r);
+}
+
+/* Copies 'len' bytes at the end of the rope, filling the last chunk first.
+ * Returns 0, or -1 when a chunk can't be allocated, in which case the bytes
+ * that did fit stay appended. */
+int dss_rope_concatb(dss_rope *r, const void *t, size_t len) {
+  const char *p = t;
+
+  while (len > 0) {
+    dss_rope_chunk *c = r->tail;
+    if (!c || c->len == r->chunk_size) {
+      c = dss_malloc(sizeof(dss_rope_chunk) + r->chunk_size);
+      if (!c) {
+        fprintf(stderr, "Not able to allocate memory.");
+        return -1;
+      }
+      c->next = NULL;
+      c->len = 0;
+      if (r->tail)
+        r->tail->next = c;
+      else
+        r->head = c;
+      r->tail = c;
+      r->nchunks++;
+    }
+    size_t n = r->chunk_size - c->len;
+    if (n > len)
+      n = len;
+    memcpy(c->data + c->len, p, n);
+    c->len += n;
+    r->len += n;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int dss_rope_concat(dss_rope *r, const char *t) {
+  return dss_rope_concatb(r, t, strlen(t));
+}
+
+/* Number of bytes held by the rope */
+size_t dss_rope_len(const dss_rope *r) { return r->len; }
+
+/* Number of chunks, i.e. of iovecs needed to describe the rope */
+size_t dss_rope_chunks(const dss_rope *r) { return r->nchunks; }
+
+/* Describes up to 'iovcnt' chunks of the rope, starting at chunk number
+ * 'first', in 'iov'. Returns the number of iovecs filled. The iovecs point
+ * into the rope and stay valid until it is changed. */
+int dss_rope_iov(const dss_rope *r, size_t first, struct iovec *iov,
+                 int iovcnt) {
+  dss_rope_chunk *c = r->head;
+  int n = 0;
+  while (c && first > 0) {
+    c = c->next;
+    first--;
+  }
+  for (; c && n < iovcnt; c = c->next, n++) {
+    iov[n].iov_base = c->data;
+    iov[n].iov_len = c->len;
+  }
+  return n;
+}
+
+/* Writes every iovec of 'iov' to 'fd', retrying on partial writes and
+ * EINTR. The array is consumed in the process. Returns the number of bytes
+ * written or -1 on error. */
+static ssize_t dss_writev_full(int fd, struct iovec *iov, int iovcnt) {
+  ssize_t total = 0;
+
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    total += n;
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return total;
+}
+
+/* Number of iovecs handed to a single writev call */
+#define DSS_IOV_BATCH 64
+
+/* Writes the whole rope to 'fd' with writev, without flattening it.
+ * Returns the number of bytes written or -1 on error. */
+ssize_t dss_rope_writev(const dss_rope *r, int fd) {
+  struct iovec iov[DSS_IOV_BATCH];
+  ssize_t total = 0;
+  dss_rope_chunk *c = r->head;
+
+  while (c) {
+    int n = 0;
+    for (; c && n < DSS_IOV_BATCH; c = c->next, n++) {
+      iov[n].iov_base = c->data;
+      iov[n].iov_len = c->len;
+    }
+    ssize_t w = dss_writev_full(fd, iov, n);
+    if (w < 0)
+      return -1;
+    total += w;
+  }
+  return total;
+}
+
+/* Moves the content of the rope into a regular dss string with one
+ * allocation of the exact size. Every chunk is released as soon as it is
+ * copied, so the data is held about once at any time instead of twice. The
+ * rope is left empty and can be reused. */
+dss dss_rope_flatten(dss_rope *r) {
+  size_t cap = r->len + DSS_NULLT;
+  dss s = dss_alloc(cap);
+  if (!s)
+    return NULL;
+
+  char *p = s;
+  dss_rope_chunk *c = r->head;
+  while (c) {
+    dss_rope_chunk *next = c->next;
+    memcpy(p, c->data, c->len);
+    p += c->len;
+    dss_dealloc(c);
+    c = next;
+  }
+  *p = '\0';
+  dss_setlen(s, cap);
+
+  r->head = r->tail = NULL;
+  r->nchunks = 0;
+  r->len = 0;
+  return s;
+}
+
+/* Strings whose allocation reaches 'threshold' bytes are moved to their own
+ * anonymous mapping, grown with mremap where available. 0 disables it. */
+void dss_set_mmap_threshold(size_t threshold) {
+  dss_mmap_threshold = threshold;
+}
+
+/* File and socket I/O. Reads go straight into the free tail of the string
+ * and writes hand the buffers to the kernel as they are. */
+
+/* Reads at most 'max' bytes from 'fd' into the end of the string with a
+ * single read call, retried on EINTR. The string is expanded as needed
+ * beforehand. When nothing could be read, the string is returned unchanged
+ * and errno is 0 at end of file or tells what went wrong otherwise. NULL is
+ * returned only if the expansion fails. */
+dss dss_read_fd(dss s, int fd, size_t max) {
+  s = dss_expand(s, max);
+  if (!s)
+    return NULL;
+
+  ssize_t n;
+  do {
+    n = read(fd, s + dss_getlen(s) - DSS_NULLT, max);
+  } while (n < 0 && errno == EINTR);
+
+  if (n <= 0) {
+    if (n == 0)
+      errno = 0;
+    s[dss_getlen(s) - DSS_NULLT] = '\0';
+    return s;
+  }
+  return dss_commit_tail(s, n);
+}
+
+/* Size of the reads dss_readfile falls back to when the file doesn't report
+ * its size, e.g. pipes or files in /proc */
+#define DSS_READ_CHUNK 4096
+
+/* Reads the whole file at 'path' into a new string. The size reported by
+ * fstat is allocated at once, so regular files cost one allocation and no
+ * copy; huge files end up in a mapping like any huge string. Returns NULL
+ * with errno set on error. */
+dss dss_readfile(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t size = S_ISREG(st.st_mode) ? (size_t)st.st_size : 0;
+  dss s = dss_alloc(size + DSS_NULLT);
+  if (!s) {
+    close(fd);
+    errno = ENOMEM;
+    return NULL;
+  }
+  s[0] = '\0';
+
+  int err = 0;
+  while (dss_getlen(s) < dss_getcap(s)) {
+    size_t before = dss_getlen(s);
+    s = dss_read_fd(s, fd, dss_getcap(s) - before);
+    if (dss_getlen(s) == before) {
+      /* dss_read_fd leaves errno at 0 on end of file */
+      err = errno;
+      break;
+    }
+  }
+
+  /* Past the reported size, e.g. because the file grew or doesn't know
+   * its size, the rest is read through a small buffer so that probing for
+   * the end of file doesn't expand the string. An error of the first loop
+   * ends the read there. */
+  char chunk[DSS_READ_CHUNK];
+  ssize_t n;
+  while (!err && (n = read(fd, chunk, sizeof(chunk))) != 0) {
+    if (n < 0) {
+      if (errno != EINTR)
+        err = errno;
+      continue;
+    }
+    dss ns = dss_concatb(s, chunk, n);
+    if (!ns) {
+      err = ENOMEM;
+      break;
+    }
+    s = ns;
+  }
+
+  close(fd);
+  if (err) {
+    dss_free(s);
+    errno = err;
+    return NULL;
+  }
+  return s;
+}
+
+/* Writes the 'n' strings of 'arr' to 'fd' back to back, batching them into
+ * as few writev calls as possible. Null terms are not written; compressed
+ * strings are written decompressed, each copy living until its batch is
+ * out. Returns the number of bytes written or -1 with errno set. */
+ssize_t dss_writev_all(int fd, dss *arr, size_t n) {
+  struct iovec iov[DSS_IOV_BATCH];
+  dss tmp[DSS_IOV_BATCH];
+  ssize_t total = 0;
+  size_t i = 0;
+
+  while (i < n) {
+    int cnt = 0, ntmp = 0;
+    ssize_t w = 0;
+    for (; i < n && cnt < DSS_IOV_BATCH; i++) {
+      dss p = dss_readable(arr[i]);
+      if (!p) {
+        w = -1;
+        break;
+      }
+      if (p != arr[i])
+        tmp[ntmp++] = p;
+      size_t len = dss_getlen(p) - DSS_NULLT;
+      if (len == 0)
+        continue;
+      iov[cnt].iov_base = p;
+      iov[cnt].iov_len = len;
+      cnt++;
+    }
+    if (w == 0)
+      w = dss_writev_full(fd, iov, cnt);
+    int err = errno;
+    while (ntmp > 0)
+      dss_free(tmp[--ntmp]);
+    if (w < 0) {
+      errno = err;
+      return -1;
+    }
+    total += w;
+  }
+  return total;
+}
+
+/* Multi-producer append buffer. Producers reserve room with a single
+ * fetch-add on a word that holds both the index of the current segment and
+ * the offset of the next reservation in it, so a reservation is always
+ * counted in the segment it lands in, and copy their bytes concurrently.
+ * The producer whose reservation crosses the end of the segment opens the
+ * next one and seals this one; the producers that came after it wait for
+ * that and try again. Records are never split: one that doesn't fit starts
+ * the next segment, one larger than a segment gets a segment of its own.
+ * Segments sit in a ring and are handed to the consumer as dss strings once
+ * every byte reserved in them has been copied. */
+
+#define DSS_MPSC_OFF_BITS 48
+#define DSS_MPSC_OFF_MASK (((uint64_t)1 << DSS_MPSC_OFF_BITS) - 1)
+/* Largest record, small enough that the reservations of the producers
+ * waiting on a crossing can't carry the offset into the index */
+#define DSS_MPSC_MAX_RECORD ((size_t)1 << 36)
+#define DSS_MPSC_MAX_SEGMENTS ((size_t)1 << (64 - DSS_MPSC_OFF_BITS))
+#define DSS_MPSC_SEGMENTS 64
+#define DSS_MPSC_SEGMENT_SIZE (1 << 20)
+/* final of a segment that is still being filled */
+#define DSS_MPSC_OPEN SIZE_MAX
+/* Fields written by different threads are kept this far apart */
+#define DSS_MPSC_LINE 64
+
+typedef struct {
+  /* Bytes of the segment, NULL while the slot is free */
+  dss buf;
+  /* Length the segment was sealed at */
+  size_t final;
+  /* Bytes copied into the segment so far */
+  size_t committed;
+  char pad[DSS_MPSC_LINE - sizeof(dss) - 2 * sizeof(size_t)];
+} dss_mpsc_slot;
+
+struct dss_mpsc {
+  size_t seg_size;
+  size_t mask;
+  /* Next segment for the consumer */
+  uint64_t head;
+  char pad0[DSS_MPSC_LINE];
+  /* Index of the current segment in the high bits, offset in the low ones */
+  uint64_t state;
+  char pad1[DSS_MPSC_LINE];
+  dss_mpsc_slot slots[];
+};
+
+/* Creates a buffer of 'segments' segments of 'segment_size' bytes, 0
+ * picking the defaults. The count is rounded up to a power of two. */
+dss_mpsc *dss_mpsc_new(size_t segment_size, size_t segments) {
+  if (segment_size == 0)
+    segment_size = DSS_MPSC_SEGMENT_SIZE;
+  if (segments == 0)
+    segments = DSS_MPSC_SEGMENTS;
+  if (segment_size > DSS_MPSC_MAX_RECORD ||
+      segments > DSS_MPSC_MAX_SEGMENTS) {
+    errno = EINVAL;
+    return NULL;
+  }
+  size_t n = 2;
+  while (n < segments)
+    n <<= 1;
+
+  dss_mpsc *q = dss_malloc(sizeof(dss_mpsc) + n * sizeof(dss_mpsc_slot));
+  if (!q) {
+    fprintf(stderr, "Not able to allocate memory.");
+    return NULL;
+  }
+  q->seg_size = segment_size;
+  q->mask = n - 1;
+  q->head = 0;
+  q->state = 0;
+  for (size_t i = 0; i < n; i++)
+    q->slots[i].buf = NULL;
+  q->slots[0].buf = dss_alloc(segment_size + DSS_NULLT);
+  if (!q->slots[0].buf) {
+    dss_dealloc(q);
+    return NULL;
+  }
+  q->slots[0].final = DSS_MPSC_OPEN;
+  q->slots[0].committed = 0;
+  return q;
+}
+
+/* Frees the buffer and the segments still in it. No producer may be using
+ * it any more. */
+void dss_mpsc_free(dss_mpsc *q) {
+  if (!q)
+    return;
+  for (size_t i = 0; i <= q->mask; i++)
+    dss_free(q->slots[i].buf);
+  dss_dealloc(q);
+}
+
+static inline dss_mpsc_slot *dss_mpsc_slot_of(dss_mpsc *q, uint64_t idx) {
+  return &q->slots[idx & q->mask];
+}
+
+static inline uint64_t dss_mpsc_state(uint64_t idx, size_t off) {
+  return idx << DSS_MPSC_OFF_BITS | off;
+}
+
+static inline void dss_mpsc_pause(unsigned *spins) {
+  if (++*spins < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  } else {
+    sched_yield();
+  }
+}
+
+/* Waits until the segment 'idx' has been sealed by the producer that
+ * crossed its end, or that producer gave up */
+static void dss_mpsc_wait(dss_mpsc *q, uint64_t idx) {
+  unsigned spins = 0;
+  for (;;) {
+    uint64_t st = __atomic_load_n(&q->state, __ATOMIC_ACQUIRE);
+    if (st >> DSS_MPSC_OFF_BITS != idx ||
+        (st & DSS_MPSC_OFF_MASK) <= q->seg_size)
+      return;
+    dss_mpsc_pause(&spins);
+  }
+}
+
+/* Puts 'buf' in the slot of segment 'idx' once the consumer is done with
+ * what was there, 'used' bytes of it being filled already */
+static void dss_mpsc_open(dss_mpsc *q, uint64_t idx, dss buf, size_t used) {
+  dss_mpsc_slot *sl = dss_mpsc_slot_of(q, idx);
+  unsigned spins = 0;
+  while (__atomic_load_n(&sl->buf, __ATOMIC_ACQUIRE))
+    dss_mpsc_pause(&spins);
+  __atomic_store_n(&sl->final, DSS_MPSC_OPEN, __ATOMIC_RELAXED);
+  __atomic_store_n(&sl->committed, used, __ATOMIC_RELAXED);
+  __atomic_store_n(&sl->buf, buf, __ATOMIC_RELEASE);
+}
+
+/* Run by the producer whose reservation of 'len' bytes at 'off' crossed the
+ * end of segment 'idx'. The segment is sealed at 'off' first, so that the
+ * consumer can free its slot while the next ones are opened. The record
+ * goes at the start of the next segment, or in a segment of its own when it
+ * is too large. Unless 'wait' is set, nothing is done when the next slot of
+ * the ring is not free. On failure the reservation is undone and -1 is
+ * returned. */
+static int dss_mpsc_roll(dss_mpsc *q, uint64_t idx, size_t off, const void *t,
+                         size_t len, int wait) {
+  int big = len > q->seg_size;
+  uint64_t next = idx + 1;
+  dss own = NULL, seg = NULL;
+
+  if (!wait &&
+      __atomic_load_n(&dss_mpsc_slot_of(q, next)->buf, __ATOMIC_ACQUIRE))
+    goto undo;
+  seg = dss_alloc(q->seg_size + DSS_NULLT);
+  if (!seg || (big && !(own = dss_alloc(len + DSS_NULLT))))
+    goto undo;
+
+  __atomic_store_n(&dss_mpsc_slot_of(q, idx)->final, off, __ATOMIC_RELEASE);
+  if (big) {
+    dss_mpsc_open(q, next, own, len);
+    memcpy(own, t, len);
+    __atomic_store_n(&dss_mpsc_slot_of(q, next)->final, len,
+                     __ATOMIC_RELEASE);
+    next++;
+    len = 0;
+  }
+  dss_mpsc_open(q, next, seg, len);
+  if (len)
+    memcpy(seg, t, len);
+  __atomic_store_n(&q->state, dss_mpsc_state(next, len), __ATOMIC_RELEASE);
+  return 0;
+
+undo:
+  dss_free(seg);
+  dss_free(own);
+  /* Every reservation made since this one failed, it is safe to forget
+   * them */
+  __atomic_store_n(&q->state, dss_mpsc_state(idx, off), __ATOMIC_RELEASE);
+  return -1;
+}
+
+/* Appends 'len' bytes as one record. Safe to call from any number of
+ * producer threads at once. When every segment of the ring is waiting to be
+ * drained, the append that opens the next segment, and the ones queued
+ * behind it, block until the consumer frees a slot; the thread that drains
+ * the buffer must therefore never append to it, or it waits for itself.
+ * Returns -1 if a segment can't be allocated, or with errno EINVAL if the
+ * record is too long. */
+int dss_mpsc_append(dss_mpsc *q, const void *t, size_t len) {
+  if (len == 0)
+    return 0;
+  if (len > DSS_MPSC_MAX_RECORD) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (;;) {
+    uint64_t st = __atomic_fetch_add(&q->state, len, __ATOMIC_ACQ_REL);
+    uint64_t idx = st >> DSS_MPSC_OFF_BITS;
+    size_t off = st & DSS_MPSC_OFF_MASK;
+    if (off + len <= q->seg_size) {
+      dss_mpsc_slot *sl = dss_mpsc_slot_of(q, idx);
+      memcpy(sl->buf + off, t, len);
+      __atomic_fetch_add(&sl->committed, len, __ATOMIC_RELEASE);
+      return 0;
+    }
+    if (off <= q->seg_size)
+      return dss_mpsc_roll(q, idx, off, t, len, 1);
+    dss_mpsc_wait(q, idx);
+  }
+}
+
+/* Seals the current segment, so that what was appended to it so far can be
+ * drained. It never waits: -1 is returned when the next segment of the ring
+ * isn't free yet, in which case there is something to drain already. */
+int dss_mpsc_flush(dss_mpsc *q) {
+  uint64_t st =
+      __atomic_fetch_add(&q->state, q->seg_size + 1, __ATOMIC_ACQ_REL);
+  uint64_t idx = st >> DSS_MPSC_OFF_BITS;
+  size_t off = st & DSS_MPSC_OFF_MASK;
+  if (off == 0) {
+    __atomic_store_n(&q->state, st, __ATOMIC_RELEASE);
+    return 0;
+  }
+  /* Otherwise a producer is sealing it already. Waiting for that could
+   * wait for the consumer itself. */
+  if (off <= q->seg_size)
+    return dss_mpsc_roll(q, idx, off, NULL, 0, 0);
+  return 0;
+}
+
+/* Slot of the 'i'th segment after the head when it is sealed and complete,
+ * NULL otherwise */
+static dss_mpsc_slot *dss_mpsc_ready(dss_mpsc *q, uint64_t i) {
+  dss_mpsc_slot *sl = dss_mpsc_slot_of(q, q->head + i);
+  if (i > q->mask || !__atomic_load_n(&sl->buf, __ATOMIC_ACQUIRE))
+    return NULL;
+  size_t final = __atomic_load_n(&sl->final, __ATOMIC_ACQUIRE);
+  if (final == DSS_MPSC_OPEN ||
+      __atomic_load_n(&sl->committed, __ATOMIC_ACQUIRE) != final)
+    return NULL;
+  return sl;
+}
+
+/* Takes the oldest complete segment out of the buffer as a regular string,
+ * or returns NULL if there is none. Only one thread may drain a buffer. */
+dss dss_mpsc_pop(dss_mpsc *q) {
+  dss_mpsc_slot *sl;
+  while ((sl = dss_mpsc_ready(q, 0))) {
+    dss s = sl->buf;
+    size_t final = sl->final;
+    q->head++;
+    /* From here on the slot belongs to the producers again */
+    __atomic_store_n(&sl->buf, NULL, __ATOMIC_RELEASE);
+    if (final == 0) {
+      dss_free(s);
+      continue;
+    }
+    s[final] = '\0';
+    dss_setlen(s, final + DSS_NULLT);
+    return s;
+  }
+  return NULL;
+}
+
+/* Fills 'iov' with the segments dss_mpsc_pop would return, without taking
+ * them. Returns how many iovecs were filled. */
+int dss_mpsc_iov(dss_mpsc *q, struct iovec *iov, int iovcnt) {
+  dss_mpsc_slot *sl;
+  int n = 0;
+  for (uint64_t i = 0; n < iovcnt && (sl = dss_mpsc_ready(q, i)); i++) {
+    if (sl->final == 0)
+      continue;
+    iov[n].iov_base = sl->buf;
+    iov[n].iov_len = sl->final;
+    n++;
+  }
+  return n;
+}
+
+/* Drops the segments behind the first 'n' iovecs of dss_mpsc_iov */
+void dss_mpsc_consume(dss_mpsc *q, int n) {
+  while (n-- > 0)
+    dss_free(dss_mpsc_pop(q));
+}
+
+/* Writes the complete segments to 'fd' with writev and drops them. Returns
+ * the number of bytes written or -1 on error. */
+ssize_t dss_mpsc_writev(dss_mpsc *q, int fd) {
+  struct iovec iov[DSS_IOV_BATCH];
+  ssize_t total = 0;
+  int n;
+
+  while ((n = dss_mpsc_iov(q, iov, DSS_IOV_BATCH)) > 0) {
+    ssize_t w = dss_writev_full(fd, iov, n);
+    if (w < 0)
+      return -1;
+    dss_mpsc_consume(q, n);
+    total += w;
+  }
+  return total;
+}
+
+/* Substring search. Needles of two bytes or more are found with the SIMD
+ * filter described by Wojciech Mula: the first and the last byte of the
+ * needle are compared against a whole vector of candidate positions at once
+ * and only positions where both match are verified with memcmp. The widest
+ * kernel the CPU supports is picked on first use, falling back to memmem on
+ * other architectures. Single bytes go to the libc memchr/memrchr, which are
+ * vectorized already. */
+
+typedef ssize_t (*dss_search_fn)(const char *, size_t, const char *, size_t);
+
+/* Forward search over the candidate positions [from, n - k] */
+static ssize_t dss_search_tail(const char *h, size_t n, size_t from,
+                               const char *needle, size_t k) {
+  const char *p = memmem(h + from, n - from, needle, k);
+  return p ? p - h : -1;
+}
+
+/* Reverse search over the candidate positions [0, end) */
+static ssize_t dss_rsearch_head(const char *h, size_t end, const char *needle,
+                                size_t k) {
+  while (end-- > 0) {
+    if (h[end] == needle[0] && h[end + k - 1] == needle[k - 1] &&
+        memcmp(h + end, needle, k) == 0)
+      return end;
+  }
+  return -1;
+}
+
+static ssize_t dss_search_scalar(const char *h, size_t n, const char *needle,
+                                 size_t k) {
+  return dss_search_tail(h, n, 0, needle, k);
+}
+
+static ssize_t dss_rsearch_scalar(const char *h, size_t n, const char *needle,
+                                  size_t k) {
+  return dss_rsearch_head(h, n - k + 1, needle, k);
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define DSS_HAVE_X86_SIMD 1
+
+__attribute__((target("sse2"))) static ssize_t
+dss_search_sse2(const char *h, size_t n, const char *needle, size_t k) {
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[k - 1]);
+  size_t i = 0;
+
+  for (; i + k - 1 + 16 <= n; i += 16) {
+    __m128i bf = _mm_loadu_si128((const __m128i *)(h + i));
+    __m128i bl = _mm_loadu_si128((const __m128i *)(h + i + k - 1));
+    unsigned mask = (unsigned)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(first, bf), _mm_cmpeq_epi8(last, bl)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(h + i + bit + 1, needle + 1, k - 2) == 0)
+        return i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return dss_search_tail(h, n, i, needle, k);
+}
+
+__attribute__((target("sse2"))) static ssize_t
+dss_rsearch_sse2(const char *h, size_t n, const char *needle, size_t k) {
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[k - 1]);
+  size_t end = n - k + 1;
+
+  while (end >= 16) {
+    size_t i = end - 16;
+    __m128i bf = _mm_loadu_si128((const __m128i *)(h + i));
+    __m128i bl = _mm_loadu_si128((const __m128i *)(h + i + k - 1));
+    unsigned mask = (unsigned)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(first, bf), _mm_cmpeq_epi8(last, bl)));
+    while (mask) {
+      int bit = 31 - __builtin_clz(mask);
+      if (memcmp(h + i + bit + 1, needle + 1, k - 2) == 0)
+        return i + bit;
+      mask &= ~(1u << bit);
+    }
+    end = i;
+  }
+  return dss_rsearch_head(h, end, needle, k);
+}
+
+__attribute__((target("avx2"))) static ssize_t
+dss_search_avx2(const char *h, size_t n, const char *needle, size_t k) {
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[k - 1]);
+  size_t i = 0;
+
+  for (; i + k - 1 + 32 <= n; i += 32) {
+    __m256i bf = _mm256_loadu_si256((const __m256i *)(h + i));
+    __m256i bl = _mm256_loadu_si256((const __m256i *)(h + i + k - 1));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(first, bf), _mm256_cmpeq_epi8(last, bl)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(h + i + bit + 1, needle + 1, k - 2) == 0)
+        return i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return dss_search_tail(h, n, i, needle, k);
+}
+
+__attribute__((target("avx2"))) static ssize_t
+dss_rsearch_avx2(const char *h, size_t n, const char *needle, size_t k) {
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[k - 1]);
+  size_t end = n - k + 1;
+
+  while (end >= 32) {
+    size_t i = end - 32;
+    __m256i bf = _mm256_loadu_si256((const __m256i *)(h + i));
+    __m256i bl = _mm256_loadu_si256((const __m256i *)(h + i + k - 1));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(first, bf), _mm256_cmpeq_epi8(last, bl)));
+    while (mask) {
+      int bit = 31 - __builtin_clz(mask);
+      if (memcmp(h + i + bit + 1, needle + 1, k - 2) == 0)
+        return i + bit;
+      mask &= ~(1u << bit);
+    }
+    end = i;
+  }
+  return dss_rsearch_head(h, end, needle, k);
+}
+#endif
+
+static dss_search_fn dss_search_impl;
+static dss_search_fn dss_rsearch_impl;
+
+/* Picks the kernels for this CPU. Racing threads store the same pointers,
+ * so no locking is needed. */
+static void dss_search_init(void) {
+  dss_search_fn fwd = dss_search_scalar, rev = dss_rsearch_scalar;
+#ifdef DSS_HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    fwd = dss_search_avx2;
+    rev = dss_rsearch_avx2;
+  } else {
+    fwd = dss_search_sse2;
+    rev = dss_rsearch_sse2;
+  }
+#endif
+  __atomic_store_n(&dss_rsearch_impl, rev, __ATOMIC_RELAXED);
+  __atomic_store_n(&dss_search_impl, fwd, __ATOMIC_RELEASE);
+}
+
+/* Offset of the first occurrence of 'needle' in 'h', or -1 */
+static ssize_t dss_search(const char *h, size_t n, const void *needle,
+                          size_t k) {
+  if (k == 0)
+    return 0;
+  if (k > n)
+    return -1;
+  if (k == 1) {
+    const char *p = memchr(h, *(const char *)needle, n);
+    return p ? p - h : -1;
+  }
+  dss_search_fn fn = __atomic_load_n(&dss_search_impl, __ATOMIC_ACQUIRE);
+  if (!fn) {
+    dss_search_init();
+    fn = dss_search_impl;
+  }
+  return fn(h, n, needle, k);
+}
+
+/* Offset of the last occurrence of 'needle' in 'h', or -1 */
+static ssize_t dss_rsearch(const char *h, size_t n, const void *needle,
+                           size_t k) {
+  if (k == 0)
+    return n;
+  if (k > n)
+    return -1;
+  if (k == 1) {
+    const char *p = memrchr(h, *(const char *)needle, n);
+    return p ? p - h : -1;
+  }
+  if (!__atomic_load_n(&dss_search_impl, __ATOMIC_ACQUIRE))
+    dss_search_init();
+  return dss_rsearch_impl(h, n, needle, k);
+}
+
+/* Offset of the first occurrence of the 'len' bytes at 'needle' in the
+ * string, or -1. Embedded null bytes are searched like any other byte.
+ * Like every search below, it decompresses a compressed string in full on
+ * each call. */
+ssize_t dss_find(const dss s, const void *needle, size_t len) {
+  dss p = dss_readable(s);
+  if (!p)
+    return -1;
+  ssize_t at = dss_search(p, dss_getlen(p) - DSS_NULLT, needle, len);
+  dss_readable_done(s, p);
+  return at;
+}
+
+/* Offset of the last occurrence of 'needle' in the string, or -1 */
+ssize_t dss_rfind(const dss s, const void *needle, size_t len) {
+  dss p = dss_readable(s);
+  if (!p)
+    return -1;
+  ssize_t at = dss_rsearch(p, dss_getlen(p) - DSS_NULLT, needle, len);
+  dss_readable_done(s, p);
+  return at;
+}
+
+/* Finds every non overlapping occurrence of 'needle' in one pass. The
+ * offsets of the first 'max' of them are stored in 'offsets', and the total
+ * number of occurrences is returned. An empty needle matches nothing. */
+size_t dss_find_all(const dss s, const void *needle, size_t len,
+                    size_t *offsets, size_t max) {
+  size_t pos = 0, count = 0;
+  ssize_t at;
+
+  if (len == 0)
+    return 0;
+  dss p = dss_readable(s);
+  if (!p)
+    return 0;
+  size_t n = dss_getlen(p) - DSS_NULLT;
+  while (pos < n && (at = dss_search(p + pos, n - pos, needle, len)) >= 0) {
+    if (count < max)
+      offsets[count] = pos + at;
+    count++;
+    pos += at + len;
+  }
+  dss_readable_done(s, p);
+  return count;
+}
+
+/* Number of non overlapping occurrences of 'needle' in the string */
+size_t dss_count(const dss s, const void *needle, size_t len) {
+  return dss_find_all(s, needle, len, NULL, 0);
+}
+
+/* Hex and base64. The output size is known before encoding or decoding, so
+ * the string is expanded once and the bytes are written straight into its
+ * tail. Vector kernels handle as many whole blocks as they can, the scalar
+ * code the rest. Decoders validate while they decode: a vector kernel stops
+ * at the first block it can't decode and the scalar code carries on from
+ * there, so it is always the scalar code that reports a bad character. */
+
+static const char dss_hexdig[16] = "0123456789abcdef";
+static const char dss_b64dig[64] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Value of every base64 digit, 0xff for anything else */
+static const unsigned char dss_b64val[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+    0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12,
+    0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24,
+    0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30,
+    0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff,
+};
+
+/* A kernel converts whole blocks from 'src' into 'dst' and returns how
+ * many bytes of 'src' it consumed. */
+typedef size_t (*dss_codec_fn)(char *dst, const unsigned char *src, size_t n);
+
+typedef struct {
+  dss_codec_fn hex_enc;
+  dss_codec_fn hex_dec;
+  dss_codec_fn b64_enc;
+  dss_codec_fn b64_dec;
+} dss_codec;
+
+static size_t dss_codec_none(char *dst, const unsigned char *src, size_t n) {
+  (void)dst;
+  (void)src;
+  (void)n;
+  return 0;
+}
+
+static const dss_codec dss_codec_scalar = {dss_codec_none, dss_codec_none,
+                                           dss_codec_none, dss_codec_none};
+
+#ifdef DSS_HAVE_X86_SIMD
+/* Nibbles of the 16 hex digits at 'p' into 'nib'. Returns 0 if one of them
+ * is not a hex digit. */
+__attribute__((target("ssse3"))) static inline int
+dss_hex_nibbles_sse(const unsigned char *p, __m128i *nib) {
+  __m128i c = _mm_loadu_si128((const __m128i *)p);
+  __m128i l = _mm_or_si128(c, _mm_set1_epi8(0x20));
+  __m128i isd = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                              _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), c));
+  __m128i isa = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)),
+                              _mm_cmpgt_epi8(_mm_set1_epi8('f' + 1), l));
+  __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+  __m128i a = _mm_sub_epi8(l, _mm_set1_epi8('a' - 10));
+  *nib = _mm_or_si128(_mm_and_si128(isd, d), _mm_and_si128(isa, a));
+  return _mm_movemask_epi8(_mm_or_si128(isd, isa)) == 0xffff;
+}
+
+__attribute__((target("ssse3"))) static size_t
+dss_hex_enc_ssse3(char *dst, const unsigned char *src, size_t n) {
+  const __m128i lut = _mm_loadu_si128((const __m128i *)dss_hexdig);
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i hi =
+        _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(in, 4), mask));
+    __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(in, mask));
+    _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(dst + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+  }
+  return i;
+}
+
+__attribute__((target("ssse3"))) static size_t
+dss_hex_dec_ssse3(char *dst, const unsigned char *src, size_t n) {
+  /* Each pair of nibbles becomes hi * 16 + lo */
+  const __m128i weights = _mm_set1_epi16(0x0110);
+  size_t i = 0;
+
+  for (; i + 32 <= n; i += 32) {
+    __m128i a, b;
+    if (!dss_hex_nibbles_sse(src + i, &a) ||
+        !dss_hex_nibbles_sse(src + i + 16, &b))
+      break;
+    a = _mm_maddubs_epi16(a, weights);
+    b = _mm_maddubs_epi16(b, weights);
+    _mm_storeu_si128((__m128i *)(dst + i / 2), _mm_packus_epi16(a, b));
+  }
+  return i;
+}
+
+/* 6-bit indices of the base64 digits of the 3-byte groups held in the
+ * first 12 bytes of every 16-byte lane, after Wojciech Mula's "Base64
+ * encoding with SIMD instructions". */
+__attribute__((target("ssse3"))) static inline __m128i
+dss_b64_digits_sse(__m128i in) {
+  in = _mm_shuffle_epi8(
+      in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  __m128i idx = _mm_or_si128(t1, t3);
+
+  /* Offset from the index to the ASCII digit, picked by range */
+  const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                                      '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                      '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                      '/' - 63, 'A', 0, 0);
+  __m128i r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+  __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+  r = _mm_or_si128(r, _mm_and_si128(less, _mm_set1_epi8(13)));
+  return _mm_add_epi8(_mm_shuffle_epi8(shift, r), idx);
+}
+
+__attribute__((target("ssse3"))) static size_t
+dss_b64_enc_ssse3(char *dst, const unsigned char *src, size_t n) {
+  size_t i = 0, o = 0;
+
+  /* 16 bytes are loaded for the 12 that are encoded */
+  for (; i + 16 <= n; i += 12, o += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + o), dss_b64_digits_sse(in));
+  }
+  return i;
+}
+
+/* Base64 digits to 6-bit values, after the decoder of Wojciech Mula and
+ * Daniel Lemire. lut_lo and lut_hi classify every byte by its low and high
+ * nibble, a byte is valid if the two classes don't intersect. lut_roll is
+ * the offset from the digit to its value. */
+#define DSS_B64_LUT_LO                                                         \
+  0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a,      \
+      0x1b, 0x1b, 0x1b, 0x1a
+#define DSS_B64_LUT_HI                                                         \
+  0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10,      \
+      0x10, 0x10, 0x10, 0x10
+#define DSS_B64_LUT_ROLL                                                       \
+  0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+#define DSS_B64_PACK 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+
+__attribute__((target("ssse3"))) static size_t
+dss_b64_dec_ssse3(char *dst, const unsigned char *src, size_t n) {
+  const __m128i lut_lo = _mm_setr_epi8(DSS_B64_LUT_LO);
+  const __m128i lut_hi = _mm_setr_epi8(DSS_B64_LUT_HI);
+  const __m128i lut_roll = _mm_setr_epi8(DSS_B64_LUT_ROLL);
+  const __m128i pack = _mm_setr_epi8(DSS_B64_PACK);
+  const __m128i mask_2f = _mm_set1_epi8(0x2f);
+  size_t i = 0, o = 0;
+
+  /* 16 bytes are stored for the 12 decoded. Keeping 8 more digits for
+   * later ensures at least 4 more bytes get decoded over the extra ones. */
+  for (; i + 24 <= n; i += 16, o += 12) {
+    __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i hi_nib = _mm_and_si128(_mm_srli_epi32(in, 4), mask_2f);
+    __m128i lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(in, mask_2f));
+    __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nib);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi),
+                                         _mm_setzero_si128())) != 0xffff)
+      break;
+    __m128i eq_2f = _mm_cmpeq_epi8(in, mask_2f);
+    __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nib));
+    __m128i v = _mm_add_epi8(in, roll);
+    v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+    v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+    _mm_storeu_si128((__m128i *)(dst + o), _mm_shuffle_epi8(v, pack));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static inline int
+dss_hex_nibbles_avx2(const unsigned char *p, __m256i *nib) {
+  __m256i c = _mm256_loadu_si256((const __m256i *)p);
+  __m256i l = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+  __m256i isd =
+      _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+                       _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+  __m256i isa =
+      _mm256_and_si256(_mm256_cmpgt_epi8(l, _mm256_set1_epi8('a' - 1)),
+                       _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), l));
+  __m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+  __m256i a = _mm256_sub_epi8(l, _mm256_set1_epi8('a' - 10));
+  *nib = _mm256_or_si256(_mm256_and_si256(isd, d), _mm256_and_si256(isa, a));
+  return _mm256_movemask_epi8(_mm256_or_si256(isd, isa)) == -1;
+}
+
+__attribute__((target("avx2"))) static size_t
+dss_hex_enc_avx2(char *dst, const unsigned char *src, size_t n) {
+  const __m256i lut = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *)dss_hexdig));
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+  size_t i = 0;
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i in = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i hi = _mm256_shuffle_epi8(
+        lut, _mm256_and_si256(_mm256_srli_epi16(in, 4), mask));
+    __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(in, mask));
+    /* The unpacks work within 128-bit lanes */
+    __m256i a = _mm256_unpacklo_epi8(hi, lo);
+    __m256i b = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256((__m256i *)(dst + 2 * i),
+                        _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst + 2 * i + 32),
+                        _mm256_permute2x128_si256(a, b, 0x31));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static size_t
+dss_hex_dec_avx2(char *dst, const unsigned char *src, size_t n) {
+  const __m256i weights = _mm256_set1_epi16(0x0110);
+  size_t i = 0;
+
+  for (; i + 64 <= n; i += 64) {
+    __m256i a, b;
+    if (!dss_hex_nibbles_avx2(src + i, &a) ||
+        !dss_hex_nibbles_avx2(src + i + 32, &b))
+      break;
+    a = _mm256_maddubs_epi16(a, weights);
+    b = _mm256_maddubs_epi16(b, weights);
+    __m256i r = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+    _mm256_storeu_si256((__m256i *)(dst + i / 2), r);
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static size_t
+dss_b64_enc_avx2(char *dst, const unsigned char *src, size_t n) {
+  const __m256i shift = _mm256_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  const __m256i spread = _mm256_setr_epi8(
+      1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10, 1, 0, 2, 1, 4, 3, 5,
+      4, 7, 6, 8, 7, 10, 9, 11, 10);
+  size_t i = 0, o = 0;
+
+  /* Each lane takes 12 bytes, the load of the second one ends 4 bytes past
+   * them */
+  for (; i + 28 <= n; i += 24, o += 32) {
+    __m256i in = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(src + i))),
+        _mm_loadu_si128((const __m128i *)(src + i + 12)), 1);
+    in = _mm256_shuffle_epi8(in, spread);
+    __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    __m256i idx = _mm256_or_si256(t1, t3);
+    __m256i r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+    __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+    r = _mm256_or_si256(r, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+    r = _mm256_add_epi8(_mm256_shuffle_epi8(shift, r), idx);
+    _mm256_storeu_si256((__m256i *)(dst + o), r);
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static size_t
+dss_b64_dec_avx2(char *dst, const unsigned char *src, size_t n) {
+  const __m256i lut_lo = _mm256_setr_epi8(DSS_B64_LUT_LO, DSS_B64_LUT_LO);
+  const __m256i lut_hi = _mm256_setr_epi8(DSS_B64_LUT_HI, DSS_B64_LUT_HI);
+  const __m256i lut_roll =
+      _mm256_setr_epi8(DSS_B64_LUT_ROLL, DSS_B64_LUT_ROLL);
+  const __m256i pack = _mm256_setr_epi8(DSS_B64_PACK, DSS_B64_PACK);
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+  const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+  size_t i = 0, o = 0;
+
+  /* 32 bytes are stored for the 24 decoded, see dss_b64_dec_ssse3 */
+  for (; i + 48 <= n; i += 32, o += 24) {
+    __m256i in = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i hi_nib = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask_2f);
+    __m256i lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(in, mask_2f));
+    __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nib);
+    if (!_mm256_testz_si256(lo, hi))
+      break;
+    __m256i eq_2f = _mm256_cmpeq_epi8(in, mask_2f);
+    __m256i roll =
+        _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nib));
+    __m256i v = _mm256_add_epi8(in, roll);
+    v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+    v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+    v = _mm256_shuffle_epi8(v, pack);
+    _mm256_storeu_si256((__m256i *)(dst + o),
+                        _mm256_permutevar8x32_epi32(v, lanes));
+  }
+  return i;
+}
+
+static const dss_codec dss_codec_ssse3 = {dss_hex_enc_ssse3, dss_hex_dec_ssse3,
+                                          dss_b64_enc_ssse3, dss_b64_dec_ssse3};
+static const dss_codec dss_codec_avx2 = {dss_hex_enc_avx2, dss_hex_dec_avx2,
+                                         dss_b64_enc_avx2, dss_b64_dec_avx2};
+#endif
+
+static const dss_codec *dss_codec_impl;
+
+/* Picks the kernels for this CPU, like dss_search_init */
+static const dss_codec *dss_codec_get(void) {
+  const dss_codec *c = __atomic_load_n(&dss_codec_impl, __ATOMIC_ACQUIRE);
+  if (c)
+    return c;
+  c = &dss_codec_scalar;
+#ifdef DSS_HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    c = &dss_codec_avx2;
+  else if (__builtin_cpu_supports("ssse3"))
+    c = &dss_codec_ssse3;
+#endif
+  __atomic_store_n(&dss_codec_impl, c, __ATOMIC_RELEASE);
+  return c;
+}
+
+static inline int dss_hexval(unsigned char c) {
+  if ((unsigned)(c - '0') < 10)
+    return c - '0';
+  c |= 0x20;
+  if ((unsigned)(c - 'a') < 6)
+    return c - 'a' + 10;
+  return -1;
+}
+
+/* Appends the 'len' bytes at 'p' as lowercase hex digits */
+dss dss_cathex(dss s, const void *p, size_t len) {
+  const unsigned char *src = p;
+  s = dss_expand(s, 2 * len);
+  if (!s)
+    return NULL;
+
+  char *dst = s + dss_getlen(s) - DSS_NULLT;
+  size_t i = dss_codec_get()->hex_enc(dst, src, len);
+  for (; i < len; i++) {
+    dst[2 * i] = dss_hexdig[src[i] >> 4];
+    dst[2 * i + 1] = dss_hexdig[src[i] & 0x0f];
+  }
+  return dss_commit_tail(s, 2 * len);
+}
+
+/* Appends the bytes spelled by the 'len' hex digits at 'p', in either case.
+ * On success errno is 0. If the digits are not valid hex, errno is EINVAL
+ * and the string is returned unchanged. NULL is returned only if the
+ * expansion fails. */
+dss dss_cathex_decode(dss s, const void *p, size_t len) {
+  const unsigned char *src = p;
+  if (len % 2) {
+    errno = EINVAL;
+    return s;
+  }
+  s = dss_expand(s, len / 2);
+  if (!s)
+    return NULL;
+
+  char *dst = s + dss_getlen(s) - DSS_NULLT;
+  size_t i = dss_codec_get()->hex_dec(dst, src, len);
+  for (; i < len; i += 2) {
+    int hi = dss_hexval(src[i]), lo = dss_hexval(src[i + 1]);
+    if (hi < 0 || lo < 0) {
+      *dst = '\0';
+      errno = EINVAL;
+      return s;
+    }
+    dst[i / 2] = (char)(hi << 4 | lo);
+  }
+  errno = 0;
+  return dss_commit_tail(s, len / 2);
+}
+
+/* Appends the 'len' bytes at 'p' in base64 (RFC 4648), padded with '=' */
+dss dss_catbase64(dss s, const void *p, size_t len) {
+  const unsigned char *src = p;
+  size_t out = (len + 2) / 3 * 4;
+  s = dss_expand(s, out);
+  if (!s)
+    return NULL;
+
+  char *dst = s + dss_getlen(s) - DSS_NULLT;
+  size_t i = dss_codec_get()->b64_enc(dst, src, len);
+  char *d = dst + i / 3 * 4;
+  for (; i + 3 <= len; i += 3) {
+    uint32_t v = (uint32_t)src[i] << 16 | src[i + 1] << 8 | src[i + 2];
+    *d++ = dss_b64dig[v >> 18];
+    *d++ = dss_b64dig[(v >> 12) & 0x3f];
+    *d++ = dss_b64dig[(v >> 6) & 0x3f];
+    *d++ = dss_b64dig[v & 0x3f];
+  }
+  if (i < len) {
+    uint32_t v = (uint32_t)src[i] << 16;
+    if (i + 1 < len)
+      v |= src[i + 1] << 8;
+    *d++ = dss_b64dig[v >> 18];
+    *d++ = dss_b64dig[(v >> 12) & 0x3f];
+    *d++ = i + 1 < len ? dss_b64dig[(v >> 6) & 0x3f] : '=';
+    *d++ = '=';
+  }
+  return dss_commit_tail(s, out);
+}
+
+/* Appends the bytes encoded by the 'len' base64 digits at 'p'. The padding
+ * may be left out, but '=' can only appear at the end. Errors are reported
+ * like with dss_cathex_decode. */
+dss dss_catbase64_decode(dss s, const void *p, size_t len) {
+  const unsigned char *src = p;
+  size_t n = len;
+  if (n % 4 == 0 && n > 0 && src[n - 1] == '=')
+    n -= src[n - 2] == '=' ? 2 : 1;
+  if (n % 4 == 1) {
+    errno = EINVAL;
+    return s;
+  }
+  size_t out = n / 4 * 3 + (n % 4 ? n % 4 - 1 : 0);
+  s = dss_expand(s, out);
+  if (!s)
+    return NULL;
+
+  char *dst = s + dss_getlen(s) - DSS_NULLT;
+  size_t i = dss_codec_get()->b64_dec(dst, src, n);
+  char *d = dst + i / 4 * 3;
+  for (; i < n; i += 4) {
+    size_t k = n - i < 4 ? n - i : 4;
+    uint32_t v = 0;
+    for (size_t j = 0; j < k; j++) {
+      unsigned char x = dss_b64val[src[i + j]];
+      if (x == 0xff) {
+        *dst = '\0';
+        errno = EINVAL;
+        return s;
+      }
+      v |= (uint32_t)x << (18 - 6 * j);
+    }
+    *d++ = (char)(v >> 16);
+    if (k > 2)
+      *d++ = (char)(v >> 8);
+    if (k > 3)
+      *d++ = (char)v;
+  }
+  errno = 0;
+  return dss_commit_tail(s, out);
+}
+
+/* UTF-8 validation. What is known about a string is cached in its header:
+ * a check of an unchanged string only has to look at its last sequence,
+ * which may still be waiting for the bytes that complete it, and appending
+ * with dss_concatb only checks the bytes that were appended. The vector
+ * kernels are the lookup algorithm of simdjson (Keiser and Lemire). */
+
+/* Start of the last sequence of the 'n' bytes at 'p' when it is still
+ * incomplete, 'n' otherwise */
+static size_t dss_utf8_cut(const unsigned char *p, size_t n) {
+  for (size_t k = 1; k <= 3 && k <= n; k++) {
+    unsigned char c = p[n - k];
+    if ((c & 0xc0) == 0x80)
+      continue;
+    size_t need = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+    return need > k ? n - k : n;
+  }
+  return n;
+}
+
+/* Tells if the 'n' bytes at 'p' are valid UTF-8, the last sequence being
+ * allowed to stop short */
+static int dss_utf8_scalar(const unsigned char *p, size_t n) {
+  size_t i = 0;
+  while (i < n) {
+    uint64_t w;
+    if (i + 8 <= n) {
+      memcpy(&w, p + i, 8);
+      if (!(w & 0x8080808080808080ULL)) {
+        i += 8;
+        continue;
+      }
+    }
+    unsigned char c = p[i], lo = 0x80, hi = 0xbf;
+    size_t need;
+    if (c < 0x80) {
+      i++;
+      continue;
+    } else if (c < 0xc2) {
+      return 0;
+    } else if (c < 0xe0) {
+      need = 1;
+    } else if (c < 0xf0) {
+      need = 2;
+      if (c == 0xe0)
+        lo = 0xa0; /* overlong */
+      else if (c == 0xed)
+        hi = 0x9f; /* surrogate */
+    } else if (c < 0xf5) {
+      need = 3;
+      if (c == 0xf0)
+        lo = 0x90; /* overlong */
+      else if (c == 0xf4)
+        hi = 0x8f; /* above U+10FFFF */
+    } else {
+      return 0;
+    }
+    for (size_t j = 1; j <= need; j++) {
+      if (i + j == n)
+        return 1;
+      if (p[i + j] < lo || p[i + j] > hi)
+        return 0;
+      lo = 0x80;
+      hi = 0xbf;
+    }
+    i += need + 1;
+  }
+  return 1;
+}
+
+/* A kernel checks whole blocks and returns how many bytes it got through
+ * without finding an error. The last sequence it saw may be incomplete. */
+typedef size_t (*dss_utf8_fn)(const unsigned char *p, size_t n);
+
+static size_t dss_utf8_none(const unsigned char *p, size_t n) {
+  (void)p;
+  (void)n;
+  return 0;
+}
+
+#ifdef DSS_HAVE_X86_SIMD
+/* Errors found by looking at the high nibble of a byte, its low nibble and
+ * the high nibble of the byte after it. A pair is bad when a bit is set in
+ * all three. */
+#define DSS_UTF8_BYTE1_HI                                                      \
+  0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, (char)0x80, (char)0x80,      \
+      (char)0x80, (char)0x80, 0x21, 0x01, 0x15, 0x49
+#define DSS_UTF8_BYTE1_LO                                                      \
+  (char)0xe7, (char)0xa3, (char)0x83, (char)0x83, (char)0x8b, (char)0xcb,      \
+      (char)0xcb, (char)0xcb, (char)0xcb, (char)0xcb, (char)0xcb, (char)0xcb,  \
+      (char)0xcb, (char)0xdb, (char)0xcb, (char)0xcb
+#define DSS_UTF8_BYTE2_HI                                                      \
+  0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, (char)0xe6, (char)0xae,      \
+      (char)0xba, (char)0xba, 0x01, 0x01, 0x01, 0x01
+/* Bytes above these in the last three positions start a sequence that goes
+ * on in the next block */
+#define DSS_UTF8_TAIL_MAX                                                      \
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, (char)0xef, (char)0xdf,  \
+      (char)0xbf
+
+__attribute__((target("ssse3"))) static size_t
+dss_utf8_ssse3(const unsigned char *p, size_t n) {
+  const __m128i b1_hi = _mm_setr_epi8(DSS_UTF8_BYTE1_HI);
+  const __m128i b1_lo = _mm_setr_epi8(DSS_UTF8_BYTE1_LO);
+  const __m128i b2_hi = _mm_setr_epi8(DSS_UTF8_BYTE2_HI);
+  const __m128i tail_max = _mm_setr_epi8(DSS_UTF8_TAIL_MAX);
+  const __m128i nib = _mm_set1_epi8(0x0f);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i prev = zero, incomplete = zero, err;
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i *)(p + i));
+    if (_mm_movemask_epi8(in) == 0) {
+      /* ASCII is only wrong right after an unfinished sequence */
+      err = incomplete;
+      incomplete = zero;
+    } else {
+      __m128i p1 = _mm_alignr_epi8(in, prev, 15);
+      __m128i p2 = _mm_alignr_epi8(in, prev, 14);
+      __m128i p3 = _mm_alignr_epi8(in, prev, 13);
+      __m128i sc = _mm_and_si128(
+          _mm_and_si128(
+              _mm_shuffle_epi8(b1_hi,
+                               _mm_and_si128(_mm_srli_epi16(p1, 4), nib)),
+              _mm_shuffle_epi8(b1_lo, _mm_and_si128(p1, nib))),
+          _mm_shuffle_epi8(b2_hi, _mm_and_si128(_mm_srli_epi16(in, 4), nib)));
+      /* Third and fourth bytes of a sequence must be continuations */
+      __m128i must23 = _mm_or_si128(_mm_subs_epu8(p2, _mm_set1_epi8(0x60)),
+                                    _mm_subs_epu8(p3, _mm_set1_epi8(0x70)));
+      err = _mm_xor_si128(_mm_and_si128(must23, _mm_set1_epi8((char)0x80)), sc);
+      incomplete = _mm_subs_epu8(in, tail_max);
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(err, zero)) != 0xffff)
+      break;
+    prev = in;
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static size_t
+dss_utf8_avx2(const unsigned char *p, size_t n) {
+  const __m256i b1_hi = _mm256_setr_epi8(DSS_UTF8_BYTE1_HI, DSS_UTF8_BYTE1_HI);
+  const __m256i b1_lo = _mm256_setr_epi8(DSS_UTF8_BYTE1_LO, DSS_UTF8_BYTE1_LO);
+  const __m256i b2_hi = _mm256_setr_epi8(DSS_UTF8_BYTE2_HI, DSS_UTF8_BYTE2_HI);
+  const __m256i tail_max = _mm256_setr_epi8(
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      DSS_UTF8_TAIL_MAX);
+  const __m256i nib = _mm256_set1_epi8(0x0f);
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i prev = zero, incomplete = zero, err;
+  size_t i = 0;
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i in = _mm256_loadu_si256((const __m256i *)(p + i));
+    if (_mm256_movemask_epi8(in) == 0) {
+      err = incomplete;
+      incomplete = zero;
+    } else {
+      /* The bytes before 'in': the high half of prev, the low half of in */
+      __m256i back = _mm256_permute2x128_si256(prev, in, 0x21);
+      __m256i p1 = _mm256_alignr_epi8(in, back, 15);
+      __m256i p2 = _mm256_alignr_epi8(in, back, 14);
+      __m256i p3 = _mm256_alignr_epi8(in, back, 13);
+      __m256i sc = _mm256_and_si256(
+          _mm256_and_si256(
+              _mm256_shuffle_epi8(
+                  b1_hi, _mm256_and_si256(_mm256_srli_epi16(p1, 4), nib)),
+              _mm256_shuffle_epi8(b1_lo, _mm256_and_si256(p1, nib))),
+          _mm256_shuffle_epi8(
+              b2_hi, _mm256_and_si256(_mm256_srli_epi16(in, 4), nib)));
+      __m256i must23 =
+          _mm256_or_si256(_mm256_subs_epu8(p2, _mm256_set1_epi8(0x60)),
+                          _mm256_subs_epu8(p3, _mm256_set1_epi8(0x70)));
+      err = _mm256_xor_si256(
+          _mm256_and_si256(must23, _mm256_set1_epi8((char)0x80)), sc);
+      incomplete = _mm256_subs_epu8(in, tail_max);
+    }
+    if (!_mm256_testz_si256(err, err))
+      break;
+    prev = in;
+  }
+  return i;
+}
+#endif
+
+static dss_utf8_fn dss_utf8_impl;
+
+/* Picks the kernel for this CPU, like dss_codec_get */
+static dss_utf8_fn dss_utf8_get(void) {
+  dss_utf8_fn f = __atomic_load_n(&dss_utf8_impl, __ATOMIC_ACQUIRE);
+  if (f)
+    return f;
+  f = dss_utf8_none;
+#ifdef DSS_HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    f = dss_utf8_avx2;
+  else if (__builtin_cpu_supports("ssse3"))
+    f = dss_utf8_ssse3;
+#endif
+  __atomic_store_n(&dss_utf8_impl, f, __ATOMIC_RELEASE);
+  return f;
+}
+
+/* dss_utf8_scalar with the kernel of this CPU doing the bulk of it. The
+ * scalar code takes over from the start of the last sequence the kernel saw
+ * complete, which is also where it goes back to after an error. */
+static int dss_utf8_check(const unsigned char *p, size_t n) {
+  size_t i = dss_utf8_cut(p, dss_utf8_get()(p, n));
+  return dss_utf8_scalar(p + i, n - i);
+}
+
+/* Works out the UTF-8 state of 's' after bytes were appended to it at
+ * 'from', 'utf8' being its state before. Only a valid string needs to be
+ * checked again and only from its last, maybe incomplete, sequence on. */
+static void dss_utf8_update(dss s, unsigned char utf8, size_t from) {
+  if (utf8 == DSS_UTF8_VALID) {
+    const unsigned char *p = (const unsigned char *)s;
+    size_t n = dss_getlen(s) - DSS_NULLT;
+    from = dss_utf8_cut(p, from);
+    if (!dss_utf8_check(p + from, n - from))
+      utf8 = DSS_UTF8_INVALID;
+  }
+  DSS_TYPEBYTE(s) |= utf8;
+}
+
+/* Tells if the string is valid UTF-8. The answer is kept in the header for
+ * the next call, until the string is changed. Unless it is known to be
+ * invalid, a compressed string is decompressed on every call, as the last
+ * sequence is looked at again to tell if it is complete. */
+int dss_is_utf8(const dss s) {
+  unsigned char utf8 =
+      __atomic_load_n(&DSS_TYPEBYTE(s), __ATOMIC_RELAXED) & DSS_UTF8_MASK;
+  if (utf8 == DSS_UTF8_INVALID)
+    return 0;
+  dss plain = dss_readable(s);
+  if (!plain)
+    return 0;
+  const unsigned char *p = (const unsigned char *)plain;
+  size_t n = dss_getlen(plain) - DSS_NULLT;
+
+  if (!utf8) {
+    utf8 = dss_utf8_check(p, n) ? DSS_UTF8_VALID : DSS_UTF8_INVALID;
+    /* Shared strings can be checked by several threads at once, they all
+     * come to the same answer */
+    __atomic_or_fetch(&DSS_TYPEBYTE(s), utf8, __ATOMIC_RELAXED);
+  }
+  int ok = utf8 == DSS_UTF8_VALID && dss_utf8_cut(p, n) == n;
+  dss_readable_done(s, plain);
+  return ok;
+}
+
+/* Compression. A compressed string holds, in place of its bytes, their
+ * length as 8 bytes followed by an LZ4 block, and has DSS_FLAG_COMPRESSED
+ * set. It is a string like any other for dss_free, dss_refshare and dss_dup.
+ * The block is written greedily with a single hash table of recent
+ * positions, which is what keeps LZ4 fast, and read back with every length
+ * and offset checked against the buffers. */
+
+#define DSS_LZ_FRAME 8
+#define DSS_LZ_MINMATCH 4
+/* The last match must start 12 bytes before the end and the last 5 bytes
+ * are always literals, as the LZ4 block format requires */
+#define DSS_LZ_MFLIMIT 12
+#define DSS_LZ_LASTLITERALS 5
+#define DSS_LZ_MAX_OFFSET 65535
+#define DSS_LZ_HASH_LOG 12
+
+static dss_compress_hook dss_compress_cb;
+
+void dss_set_compress_hook(dss_compress_hook hook) { dss_compress_cb = hook; }
+
+/* Largest block that 'n' bytes can compress to */
+static inline size_t dss_lz_bound(size_t n) { return n + n / 255 + 16; }
+
+static inline uint32_t dss_lz_read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline uint32_t dss_lz_hash(const unsigned char *p) {
+  return (dss_lz_read32(p) * 2654435761U) >> (32 - DSS_LZ_HASH_LOG);
+}
+
+/* Number of bytes 'a' and 'b' have in common, up to 'limit' */
+static inline size_t dss_lz_common(const unsigned char *a,
+                                   const unsigned char *b,
+                                   const unsigned char *limit) {
+  const unsigned char *start = a;
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (a + 8 <= limit) {
+    uint64_t x, y;
+    memcpy(&x, a, 8);
+    memcpy(&y, b, 8);
+    if (x != y)
+      return a - start + (__builtin_ctzll(x ^ y) >> 3);
+    a += 8;
+    b += 8;
+  }
+#endif
+  while (a < limit && *a == *b) {
+    a++;
+    b++;
+  }
+  return a - start;
+}
+
+static inline unsigned char *dss_lz_putlen(unsigned char *op, size_t n) {
+  for (; n >= 255; n -= 255)
+    *op++ = 255;
+  *op++ = (unsigned char)n;
+  return op;
+}
+
+/* Writes one sequence: 'lit' literals at 'src', then a match of 'ml' bytes
+ * 'off' bytes back, or no match when 'ml' is 0 */
+static unsigned char *dss_lz_sequence(unsigned char *op,
+                                      const unsigned char *src, size_t lit,
+                                      size_t off, size_t ml) {
+  unsigned char *token = op++;
+  *token = (unsigned char)((lit < 15 ? lit : 15) << 4);
+  if (lit >= 15)
+    op = dss_lz_putlen(op, lit - 15);
+  memcpy(op, src, lit);
+  op += lit;
+  if (ml == 0)
+    return op;
+  ml -= DSS_LZ_MINMATCH;
+  *token |= ml < 15 ? ml : 15;
+  *op++ = (unsigned char)off;
+  *op++ = (unsigned char)(off >> 8);
+  if (ml >= 15)
+    op = dss_lz_putlen(op, ml - 15);
+  return op;
+}
+
+/* Compresses 'n' bytes from 'src' into 'dst', which has room for
+ * dss_lz_bound(n) bytes, and returns the size of the block */
+static size_t dss_lz_compress(unsigned char *dst, const unsigned char *src,
+                              size_t n) {
+  size_t table[1 << DSS_LZ_HASH_LOG] = {0};
+  unsigned char *op = dst;
+  size_t anchor = 0, i = 0;
+
+  if (n > DSS_LZ_MFLIMIT) {
+    size_t limit = n - DSS_LZ_MFLIMIT, mlimit = n - DSS_LZ_LASTLITERALS;
+    while (i < limit) {
+      uint32_t h = dss_lz_hash(src + i);
+      size_t ref = table[h];
+      table[h] = i;
+      if (ref >= i || i - ref > DSS_LZ_MAX_OFFSET ||
+          dss_lz_read32(src + ref) != dss_lz_read32(src + i)) {
+        /* Step faster over data that doesn't compress */
+        i += 1 + ((i - anchor) >> 6);
+        continue;
+      }
+      while (i > anchor && ref > 0 && src[i - 1] == src[ref - 1]) {
+        i--;
+        ref--;
+      }
+      size_t m = i + DSS_LZ_MINMATCH;
+      m += dss_lz_common(src + m, src + ref + DSS_LZ_MINMATCH, src + mlimit);
+      op = dss_lz_sequence(op, src + anchor, i - anchor, i - ref, m - i);
+      i = anchor = m;
+      /* The bytes just before the next search are often matched again */
+      if (m - 2 < limit)
+        table[dss_lz_hash(src + m - 2)] = m - 2;
+    }
+  }
+  op = dss_lz_sequence(op, src + anchor, n - anchor, 0, 0);
+  return op - dst;
+}
+
+/* Reads a length extension at 'src[*i]', returning 0 if it runs past the
+ * end of the block */
+static int dss_lz_getlen(const unsigned char *src, size_t len, size_t *i,
+                         size_t *n) {
+  unsigned char b;
+  do {
+    if (*i >= len)
+      return 0;
+    b = src[(*i)++];
+    *n += b;
+  } while (b == 255);
+  return 1;
+}
+
+/* Decompresses the block of 'len' bytes at 'src' into the 'n' bytes at
+ * 'dst'. Returns 0 if the block doesn't decode to exactly 'n' bytes. */
+static int dss_lz_decompress(char *dst, size_t n, const unsigned char *src,
+                             size_t len) {
+  size_t i = 0, o = 0;
+  while (i < len) {
+    unsigned token = src[i++];
+    size_t lit = token >> 4, ml = token & 15;
+    if (lit == 15 && !dss_lz_getlen(src, len, &i, &lit))
+      return 0;
+    if (lit > len - i || lit > n - o)
+      return 0;
+    /* Short runs are copied 16 bytes at once when both buffers have room
+     * for it, the extra bytes being overwritten afterward */
+    if (lit <= 16 && len - i >= 16 && n - o >= 16)
+      memcpy(dst + o, src + i, 16);
+    else
+      memcpy(dst + o, src + i, lit);
+    i += lit;
+    o += lit;
+    /* The last sequence has no match */
+    if (i == len)
+      break;
+    if (len - i < 2)
+      return 0;
+    size_t off = src[i] | (size_t)src[i + 1] << 8;
+    i += 2;
+    if (ml == 15 && !dss_lz_getlen(src, len, &i, &ml))
+      return 0;
+    ml += DSS_LZ_MINMATCH;
+    if (off == 0 || off > o || ml > n - o)
+      return 0;
+    if (off >= 8 && n - o >= ml + 8) {
+      /* Each 8 bytes copied come from before the ones being written */
+      for (size_t k = 0; k < ml; k += 8)
+        memcpy(dst + o + k, dst + o + k - off, 8);
+    } else if (off >= ml) {
+      memcpy(dst + o, dst + o - off, ml);
+    } else {
+      /* The match overlaps the bytes it produces */
+      for (size_t k = 0; k < ml; k++)
+        dst[o + k] = dst[o + k - off];
+    }
+    o += ml;
+  }
+  return o == n;
+}
+
+/* Compresses the string. The compressed copy replaces the reference passed
+ * in, so other references to a shared string keep the plain bytes. A string
+ * that would not get smaller, or is already compressed, is returned as it
+ * is. NULL is returned if the copy can't be allocated. */
+dss dss_compress(dss s) {
+  size_t n = dss_getlen(s) - DSS_NULLT;
+  if (DSS_FLAGS(s) & DSS_FLAG_COMPRESSED)
+    return s;
+
+  dss ns = dss_alloc(DSS_LZ_FRAME + dss_lz_bound(n) + DSS_NULLT);
+  if (!ns)
+    return NULL;
+  uint64_t raw = n;
+  memcpy(ns, &raw, DSS_LZ_FRAME);
+  unsigned char *block = (unsigned char *)ns + DSS_LZ_FRAME;
+  size_t packed = DSS_LZ_FRAME + dss_lz_compress(block, (unsigned char *)s, n);
+  if (packed >= n) {
+    dss_release(ns);
+    return s;
+  }
+  ns[packed] = '\0';
+  dss_setlen(ns, packed + DSS_NULLT);
+  /* What is cached about the bytes still holds, it describes the plain
+   * ones */
+  dss_copy_meta(ns, s);
+  *dss_refp(ns) = 1;
+  DSS_FLAGS(ns) |= DSS_FLAG_COMPRESSED;
+
+  /* Give back what the bound reserved beyond the block */
+  dss fit = dss_resize(ns, packed + DSS_NULLT);
+  if (fit)
+    ns = fit;
+  if (dss_compress_cb)
+    dss_compress_cb(n, packed, 0);
+  dss_free(s);
+  return ns;
+}
+
+/* Decodes the block of a compressed string into a new plain string that
+ * carries none of its metadata. Returns NULL on failure, errno being EINVAL
+ * if the block is corrupt. */
+static dss dss_lz_decode(const dss s) {
+  size_t packed = dss_getlen(s) - DSS_NULLT;
+  uint64_t raw = 0;
+  if (packed >= DSS_LZ_FRAME)
+    memcpy(&raw, s, DSS_LZ_FRAME);
+  /* No byte of a block stands for more than 255 bytes of output, which
+   * catches a corrupt length before it is allocated */
+  if (packed < DSS_LZ_FRAME || raw > (packed - DSS_LZ_FRAME) * 255) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  dss ns = dss_alloc(raw + DSS_NULLT);
+  if (!ns)
+    return NULL;
+  if (!dss_lz_decompress(ns, raw, (unsigned char *)s + DSS_LZ_FRAME,
+                         packed - DSS_LZ_FRAME)) {
+    dss_release(ns);
+    errno = EINVAL;
+    return NULL;
+  }
+  ns[raw] = '\0';
+  dss_setlen(ns, raw + DSS_NULLT);
+  if (dss_compress_cb)
+    dss_compress_cb(raw, packed, 1);
+  return ns;
+}
+
+/* Gives back the plain string, replacing the reference passed in like
+ * dss_compress. A string that is not compressed is returned as it is, so it
+ * can be called before any read. On failure NULL is returned, errno being
+ * EINVAL if the compressed bytes are corrupt. */
+dss dss_decompress(dss s) {
+  if (!(DSS_FLAGS(s) & DSS_FLAG_COMPRESSED))
+    return s;
+  dss ns = dss_lz_decode(s);
+  if (!ns)
+    return NULL;
+  /* The cached UTF-8 state and hash describe the plain bytes */
+  dss_copy_meta(ns, s);
+  *dss_refp(ns) = 1;
+  DSS_FLAGS(ns) &= ~DSS_FLAG_COMPRESSED;
+  dss_free(s);
+  return ns;
+}
+
+/* Plain bytes of 's' for the functions that only read it: 's' itself, or a
+ * decompressed copy. Its reference count is not touched, so this is as safe
+ * as any read of a shared string. Give the result back with
+ * dss_readable_done. NULL is returned with errno set if 's' can't be
+ * decompressed.
+ *
+ * The copy is not kept: a read-only function can't replace the reference
+ * its caller holds, so every call on a compressed string decodes the whole
+ * block again, O(n) however little it looks at. Callers that read a cold
+ * string more than once should dss_decompress it first. */
+static dss dss_readable(const dss s) {
+  if (!(DSS_FLAGS(s) & DSS_FLAG_COMPRESSED))
+    return s;
+  return dss_lz_decode(s);
+}
+
+static void dss_readable_done(const dss s, dss p) {
+  if (p != s)
+    dss_free(p);
+}
+
+int dss_is_compressed(const dss s) {
+  return (DSS_FLAGS(s) & DSS_FLAG_COMPRESSED) != 0;
+}
+
+/* What dss_len will be once the string is decompressed */
+size_t dss_raw_len(const dss s) {
+  uint64_t raw;
+  if (!(DSS_FLAGS(s) & DSS_FLAG_COMPRESSED) ||
+      dss_getlen(s) - DSS_NULLT < DSS_LZ_FRAME)
+    return dss_getlen(s);
+  memcpy(&raw, s, DSS_LZ_FRAME);
+  return raw + DSS_NULLT;
+}
+
+/* 64-bit hash of arbitrary bytes, wyhash by Wang Yi. */
+static const uint64_t dss_wyp[4] = {
+    0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL, 0x4b33a62ed433d4a3ULL,
+    0x4d5a2da51de1aa47ULL};
+
+static inline void dss_wymum(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = *a;
+  r *= *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+#else
+  uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32), c = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  c += lo < t;
+  *a = lo;
+  *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t dss_wymix(uint64_t a, uint64_t b) {
+  dss_wymum(&a, &b);
+  return a ^ b;
+}
+
+static inline uint64_t dss_wyr8(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static inline uint64_t dss_wyr4(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline uint64_t dss_wyr3(const uint8_t *p, size_t k) {
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+static uint64_t dss_hash_bytes(const void *key, size_t len) {
+  const uint8_t *p = key;
+  const uint64_t *secret = dss_wyp;
+  uint64_t seed = dss_wymix(secret[0], secret[1]);
+  uint64_t a, b;
+
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (dss_wyr4(p) << 32) | dss_wyr4(p + ((len >> 3) << 2));
+      b = (dss_wyr4(p + len - 4) << 32) |
+          dss_wyr4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = dss_wyr3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (i >= 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = dss_wymix(dss_wyr8(p) ^ secret[1], dss_wyr8(p + 8) ^ seed);
+        see1 =
+            dss_wymix(dss_wyr8(p + 16) ^ secret[2], dss_wyr8(p + 24) ^ see1);
+        see2 =
+            dss_wymix(dss_wyr8(p + 32) ^ secret[3], dss_wyr8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i >= 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = dss_wymix(dss_wyr8(p) ^ secret[1], dss_wyr8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = dss_wyr8(p + i - 16);
+    b = dss_wyr8(p + i - 8);
+  }
+  a ^= secret[1];
+  b ^= seed;
+  dss_wymum(&a, &b);
+  return dss_wymix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+/* Hashes the plain bytes of 's' into 'h'. Returns 0 with errno set if it
+ * can't be decompressed. */
+static int dss_hash_plain(const dss s, uint64_t *h) {
+  dss p = dss_readable(s);
+  if (!p)
+    return 0;
+  *h = dss_hash_bytes(p, dss_getlen(p) - DSS_NULLT);
+  dss_readable_done(s, p);
+  return 1;
+}
+
+/* 64-bit hash of the bytes of the string, the plain ones for a compressed
+ * string, or 0 with errno set if they can't be had. When dss.c is built
+ * with DSS_HASH_CACHE, the hash is kept in the header until the string is
+ * changed, so hashing an unchanged or shared string again is O(1).
+ * Without it, each hash of a compressed string decompresses it. */
+uint64_t dss_hash(const dss s) {
+#ifdef DSS_HASH_CACHE
+  uint64_t h;
+  if (__atomic_load_n(&DSS_FLAGS(s), __ATOMIC_ACQUIRE) & DSS_FLAG_HASHED) {
+    memcpy(&h, dss_hashp(s), sizeof(h));
+    return h;
+  }
+  /* Nothing is cached for a string that can't be decompressed */
+  if (!dss_hash_plain(s, &h))
+    return 0;
+  /* Shared strings may be hashed by several threads at once. They all
+   * store the same value, and the flag is published after it. */
+  memcpy(dss_hashp(s), &h, sizeof(h));
+  __atomic_or_fetch(&DSS_FLAGS(s), DSS_FLAG_HASHED, __ATOMIC_RELEASE);
+  return h;
+#else
+  uint64_t h = 0;
+  dss_hash_plain(s, &h);
+  return h;
+#endif
+}
+
+/* Drops metadata cached about the bytes of the string. Only needed after
+ * writing into the buffer directly without changing its length, every dss
+ * function does it by itself. */
+void dss_touch(dss s) {
+#ifdef DSS_HASH_CACHE
+  DSS_FLAGS(s) &= ~DSS_FLAG_HASHED;
+#endif
+  DSS_TYPEBYTE(s) &= ~DSS_UTF8_MASK;
+}
+
+/* Tells if two strings hold the same bytes. Shared references are equal by
+ * identity, strings of different length or with different cached hashes
+ * are told apart without looking at their bytes. Compressed strings are
+ * compared by their plain bytes, decompressed for every call that gets
+ * that far; one that can't be decompressed is equal to nothing, errno
+ * being set. */
+int dss_eq(const dss a, const dss b) {
+  if (a == b)
+    return 1;
+  size_t len = dss_raw_len(a);
+  if (len != dss_raw_len(b))
+    return 0;
+#ifdef DSS_HASH_CACHE
+  if ((DSS_FLAGS(a) & DSS_FLAGS(b) & DSS_FLAG_HASHED) &&
+      memcmp(dss_hashp(a), dss_hashp(b), sizeof(uint64_t)) != 0)
+    return 0;
+#endif
+  dss pa = dss_readable(a), pb = pa ? dss_readable(b) : NULL;
+  int eq = pb && memcmp(pa, pb, len - DSS_NULLT) == 0;
+  if (pa)
+    dss_readable_done(a, pa);
+  if (pb)
+    dss_readable_done(b, pb);
+  return eq;
+}
+
+/* Orders strings like memcmp, a shorter string sorting first when it is a
+ * prefix of the other. A compressed operand is decompressed on each call,
+ * so sorting cold strings pays for it O(n log n) times. */
+int dss_cmp(const dss a, const dss b) {
+  if (a == b)
+    return 0;
+  dss pa = dss_readable(a), pb = pa ? dss_readable(b) : NULL;
+  /* A string that can't be decompressed sorts first, errno being set */
+  if (!pb) {
+    if (pa)
+      dss_readable_done(a, pa);
+    return pa ? 1 : -1;
+  }
+  size_t la = dss_getlen(pa) - DSS_NULLT, lb = dss_getlen(pb) - DSS_NULLT;
+  size_t n = la < lb ? la : lb;
+  int r = n ? memcmp(pa, pb, n) : 0;
+  if (!r)
+    r = la < lb ? -1 : la > lb;
+  dss_readable_done(a, pa);
+  dss_readable_done(b, pb);
+  return r;
+}
+
+/* String interning. A table keeps one reference on every distinct string it
+ * has handed out, in open addressing shards probed linearly. Slots keep the
+ * hash next to the string so that probing rarely touches the string itself.
+ * An entry whose ref_count is back to the table's own reference is dropped
+ * when its shard is rehashed or swept. */
+
+#define DSS_INTERN_MIN_SLOTS 16
+
+typedef struct {
+  uint64_t hash;
+  dss s;
+} dss_intern_slot;
+
+typedef struct {
+  pthread_mutex_t lock;
+  dss_intern_slot *slots;
+  /* Number of slots minus one, 0 until the first insertion */
+  size_t mask;
+  size_t count;
+} dss_intern_shard;
+
+struct dss_intern_table {
+  size_t nshards;
+  int locked;
+  dss_intern_shard shards[];
+};
+
+/* 'shards' is 0 for a table used by a single thread. Otherwise it is rounded
+ * up to a power of two, every shard gets its own lock and the strings of the
+ * table use atomic reference counting. */
+dss_intern_table *dss_intern_new(size_t shards) {
+  int locked = shards > 0;
+  size_t n = 1;
+  while (n < shards)
+    n <<= 1;
+  dss_intern_table *t =
+      dss_malloc(sizeof(dss_intern_table) + n * sizeof(dss_intern_shard));
+  if (!t) {
+    fprintf(stderr, "Not able to allocate memory.");
+    return NULL;
+  }
+  t->nshards = n;
+  t->locked = locked;
+  for (size_t i = 0; i < n; i++) {
+    dss_intern_shard *sh = &t->shards[i];
+    sh->slots = NULL;
+    sh->mask = 0;
+    sh->count = 0;
+    if (locked && pthread_mutex_init(&sh->lock, NULL) != 0) {
+      perror("pthread_mutex_init");
+      while (i--)
+        pthread_mutex_destroy(&t->shards[i].lock);
+      dss_dealloc(t);
+      return NULL;
+    }
+  }
+  return t;
+}
+
+/* Rebuilds the slots of a shard without its dead entries, sized so that the
+ * live ones and one more fill at most half of it. Nothing changes if the new
+ * slots can't be allocated. Returns how many entries were dropped, or -1. */
+static ssize_t dss_intern_rehash(dss_intern_shard *sh) {
+  size_t nslots = sh->slots ? sh->mask + 1 : 0;
+  size_t live = 0;
+  for (size_t i = 0; i < nslots; i++)
+    if (sh->slots[i].s && dss_ref_load(sh->slots[i].s) > 1)
+      live++;
+
+  size_t cap = DSS_INTERN_MIN_SLOTS;
+  while (cap < 2 * (live + 1))
+    cap <<= 1;
+  dss_intern_slot *slots = dss_malloc(cap * sizeof(dss_intern_slot));
+  if (!slots) {
+    fprintf(stderr, "Not able to allocate memory.");
+    return -1;
+  }
+  memset(slots, 0, cap * sizeof(dss_intern_slot));
+
+  ssize_t dropped = 0;
+  for (size_t i = 0; i < nslots; i++) {
+    dss_intern_slot *e = &sh->slots[i];
+    if (!e->s)
+      continue;
+    if (dss_ref_load(e->s) <= 1) {
+      dss_free(e->s);
+      dropped++;
+      continue;
+    }
+    size_t j = e->hash & (cap - 1);
+    while (slots[j].s)
+      j = (j + 1) & (cap - 1);
+    slots[j] = *e;
+  }
+  dss_dealloc(sh->slots);
+  sh->slots = slots;
+  sh->mask = cap - 1;
+  sh->count = live;
+  return dropped;
+}
+
+static dss dss_intern_shard_get(dss_intern_table *t, dss_intern_shard *sh,
+                                const void *p, size_t len, uint64_t h) {
+  size_t i;
+  if (sh->slots) {
+    for (i = h & sh->mask; sh->slots[i].s; i = (i + 1) & sh->mask) {
+      dss e = sh->slots[i].s;
+      if (sh->slots[i].hash == h && dss_getlen(e) - DSS_NULLT == len &&
+          memcmp(e, p, len) == 0)
+        return dss_refshare(e);
+    }
+  }
+  /* Keep the load under 3/4 */
+  if ((sh->count + 1) * 4 > (sh->mask + 1) * 3 && dss_intern_rehash(sh) < 0)
+    return NULL;
+
+  dss s = dss_newb(p, len);
+  if (!s)
+    return NULL;
+  if (t->locked)
+    DSS_FLAGS(s) |= DSS_FLAG_ATOMIC;
+#ifdef DSS_HASH_CACHE
+  memcpy(dss_hashp(s), &h, sizeof(h));
+  DSS_FLAGS(s) |= DSS_FLAG_HASHED;
+#endif
+  for (i = h & sh->mask; sh->slots[i].s; i = (i + 1) & sh->mask)
+    ;
+  sh->slots[i].hash = h;
+  sh->slots[i].s = s;
+  sh->count++;
+  return dss_refshare(s);
+}
+
+/* Returns a reference to the string of the table holding the 'len' bytes at
+ * 'p', adding one if there is none yet. Strings with the same bytes
+ * interned in the same table are the same pointer, so they can be compared
+ * with ==. The caller releases the reference with dss_free, and must only
+ * change the string with the COW functions. */
+dss dss_intern(dss_intern_table *t, const void *p, size_t len) {
+  uint64_t h = dss_hash_bytes(p, len);
+  dss_intern_shard *sh = &t->shards[(h >> 32) & (t->nshards - 1)];
+  if (!t->locked)
+    return dss_intern_shard_get(t, sh, p, len, h);
+  pthread_mutex_lock(&sh->lock);
+  dss s = dss_intern_shard_get(t, sh, p, len, h);
+  pthread_mutex_unlock(&sh->lock);
+  return s;
+}
+
+/* Drops the strings nobody but the table references anymore and returns how
+ * many there were. Dead entries are also dropped whenever a shard grows, so
+ * this is only needed to give memory back sooner. */
+size_t dss_intern_sweep(dss_intern_table *t) {
+  size_t dropped = 0;
+  for (size_t i = 0; i < t->nshards; i++) {
+    dss_intern_shard *sh = &t->shards[i];
+    if (t->locked)
+      pthread_mutex_lock(&sh->lock);
+    if (sh->slots) {
+      ssize_t n = dss_intern_rehash(sh);
+      if (n > 0)
+        dropped += n;
+    }
+    if (t->locked)
+      pthread_mutex_unlock(&sh->lock);
+  }
+  return dropped;
+}
+
+/* Frees the table and its references. Strings still referenced elsewhere
+ * stay valid. */
+void dss_intern_free(dss_intern_table *t) {
+  if (t == NULL)
+    return;
+  for (size_t i = 0; i < t->nshards; i++) {
+    dss_intern_shard *sh = &t->shards[i];
+    for (size_t j = 0; sh->slots && j <= sh->mask; j++)
+      dss_free(sh->slots[j].s);
+    dss_dealloc(sh->slots);
+    if (t->locked)
+      pthread_mutex_destroy(&sh->lock);
+  }
+  dss_dealloc(t);
+}
+
+/* Slices. A slice is a view of a range of bytes of a dss string. It holds a
+ * reference to the string, taken like dss_refshare does, so the bytes stay
+ * alive as long as the slice does even if the owner frees the string. The
+ * same rules as for shared references apply: while slices exist the string
+ * must only be changed through the COW functions. */
+
+/* Makes a slice of 'len' bytes of 's' starting at 'start'. Both are clamped
+ * to the string, so passing SIZE_MAX as 'len' slices up to the end. The
+ * slice of a compressed string points into a decompressed copy of its own,
+ * made for every slice; if that copy can't be made the slice is empty,
+ * errno being set. */
+dss_slice dss_slice_new(dss s, size_t start, size_t len) {
+  dss p = dss_readable(s);
+  if (!p) {
+    dss_slice none = {NULL, 0, NULL};
+    return none;
+  }
+  size_t slen = dss_getlen(p) - DSS_NULLT;
+  if (start > slen)
+    start = slen;
+  if (len > slen - start)
+    len = slen - start;
+  dss_slice v = {p + start, len, p == s ? dss_refshare(s) : p};
+  return v;
+}
+
+/* Slice of a slice. It takes its own reference to the string. */
+dss_slice dss_slice_sub(dss_slice v, size_t start, size_t len) {
+  if (start > v.len)
+    start = v.len;
+  if (len > v.len - start)
+    len = v.len - start;
+  dss_slice sub = {v.ptr + start, len, v.parent};
+  if (v.parent)
+    dss_refshare(v.parent);
+  return sub;
+}
+
+/* Drops the reference the slice holds and empties it */
+void dss_slice_release(dss_slice *v) {
+  if (v->parent)
+    dss_free(v->parent);
+  v->ptr = NULL;
+  v->len = 0;
+  v->parent = NULL;
+}
+
+/* Copies the bytes of the slice into a new, owned and null terminated
+ * string. The slice is left as it is. */
+dss dss_slice_materialize(dss_slice v) { return dss_newb(v.ptr, v.len); }
+
+int dss_slice_eq(dss_slice a, dss_slice b) {
+  return a.len == b.len && (a.ptr == b.ptr || memcmp(a.ptr, b.ptr, a.len) == 0);
+}
+
+/* Orders slices like memcmp, a shorter slice sorting first when it is a
+ * prefix of the other */
+int dss_slice_cmp(dss_slice a, dss_slice b) {
+  size_t n = a.len < b.len ? a.len : b.len;
+  int r = n ? memcmp(a.ptr, b.ptr, n) : 0;
+  if (r)
+    return r;
+  return a.len < b.len ? -1 : a.len > b.len;
+}
+
+/* Offset of the first occurrence of 'needle' in the slice, or -1 */
+ssize_t dss_slice_find(dss_slice v, const void *needle, size_t len) {
+  return dss_search(v.ptr, v.len, needle, len);
+}
+
+uint64_t dss_slice_hash(dss_slice v) { return dss_hash_bytes(v.ptr, v.len); }
+
+/* Splitting and joining. */
+
+/* Cuts the string at every occurrence of the 'seplen' bytes at 'sep' and
+ * returns the fields as slices of it, empty fields included. The number of
+ * fields is stored in 'count'. The separators are counted first so that the
+ * array is allocated once with its final size; the references the slices
+ * hold are taken in a single step as well. A compressed string is
+ * decompressed once per call, all the fields sharing the copy. Release
+ * the result with dss_slices_free. Returns NULL if 'sep' is empty or on
+ * allocation failure. */
+dss_slice *dss_split(dss s, const void *sep, size_t seplen, size_t *count) {
+  *count = 0;
+  if (seplen == 0)
+    return NULL;
+  /* Fields of a compressed string are slices of a decompressed copy, which
+   * lives as long as they do */
+  if (DSS_FLAGS(s) & DSS_FLAG_COMPRESSED) {
+    dss p = dss_readable(s);
+    if (!p)
+      return NULL;
+    dss_slice *arr = dss_split(p, sep, seplen, count);
+    dss_free(p);
+    return arr;
+  }
+
+  size_t len = dss_getlen(s) - DSS_NULLT;
+  size_t n = dss_count(s, sep, seplen) + 1;
+  dss_slice *arr = dss_malloc(n * sizeof(dss_slice));
+  if (!arr) {
+    fprintf(stderr, "Not able to allocate memory.");
+    return NULL;
+  }
+
+  size_t pos = 0;
+  for (size_t i = 0; i < n - 1; i++) {
+    size_t at = dss_search(s + pos, len - pos, sep, seplen);
+    arr[i].ptr = s + pos;
+    arr[i].len = at;
+    arr[i].parent = s;
+    pos += at + seplen;
+  }
+  arr[n - 1].ptr = s + pos;
+  arr[n - 1].len = len - pos;
+  arr[n - 1].parent = s;
+
+  dss_ref_add(s, (uint32_t)n);
+  *count = n;
+  return arr;
+}
+
+/* Splits the string into lines. Both "\n" and "\r\n" end a line, and a final
+ * line break doesn't produce an empty last line. An empty string has no
+ * lines, in which case NULL is returned and 'count' is 0. */
+dss_slice *dss_splitlines(dss s, size_t *count) {
+  if (DSS_FLAGS(s) & DSS_FLAG_COMPRESSED) {
+    dss p = dss_readable(s);
+    *count = 0;
+    if (!p)
+      return NULL;
+    dss_slice *arr = dss_splitlines(p, count);
+    dss_free(p);
+    return arr;
+  }
+  size_t len = dss_getlen(s) - DSS_NULLT;
+  dss_slice *arr = dss_split(s, "\n", 1, count);
+  if (!arr)
+    return NULL;
+
+  if (len == 0 || s[len - 1] == '\n') {
+    /* Drop the empty field after the last line break */
+    (*count)--;
+    dss_free(s);
+  }
+  for (size_t i = 0; i < *count; i++) {
+    if (arr[i].len && arr[i].ptr[arr[i].len - 1] == '\r')
+      arr[i].len--;
+  }
+  if (*count == 0) {
+    dss_dealloc(arr);
+    return NULL;
+  }
+  return arr;
+}
+
+/* Releases the slices returned by dss_split and dss_splitlines together
+ * with the array */
+void dss_slices_free(dss_slice *arr, size_t count) {
+  if (arr == NULL)
+    return;
+  for (size_t i = 0; i < count; i++)
+    dss_slice_release(&arr[i]);
+  dss_dealloc(arr);
+}
+
+/* Joins 'n' strings with 'sep' between them. The total length is computed
+ * first so the result is allocated exactly once. Compressed parts are
+ * decompressed one at a time into a copy that is dropped once it has been
+ * appended. */
+dss dss_join(const dss *parts, size_t n, const char *sep) {
+  size_t seplen = strlen(sep);
+  size_t total = n ? seplen * (n - 1) : 0;
+  for (size_t i = 0; i < n; i++)
+    total += dss_raw_len(parts[i]) - DSS_NULLT;
+
+  dss s = dss_alloc(total + DSS_NULLT);
+  if (!s)
+    return NULL;
+
+  char *p = s;
+  for (size_t i = 0; i < n; i++) {
+    dss part = dss_readable(parts[i]);
+    if (!part) {
+      int err = errno;
+      dss_release(s);
+      errno = err;
+      return NULL;
+    }
+    size_t len = dss_getlen(part) - DSS_NULLT;
+    if (i) {
+      memcpy(p, sep, seplen);
+      p += seplen;
+    }
+    memcpy(p, part, len);
+    p += len;
+    dss_readable_done(parts[i], part);
+  }
+  *p = '\0';
+  dss_setlen(s, total + DSS_NULLT);
+  return s;
+}
+
+/* Joins 'n' slices with 'sep' between them, allocating exactly once. Joining
+ * the result of dss_split with its separator gives back the original
+ * string. */
+dss dss_join_slices(const dss_slice *parts, size_t n, const char *sep) {
+  size_t seplen = strlen(sep);
+  size_t total = n ? seplen * (n - 1) : 0;
+  for (size_t i = 0; i < n; i++)
+    total += parts[i].len;
+
+  dss s = dss_alloc(total + DSS_NULLT);
+  if (!s)
+    return NULL;
+
+  char *p = s;
+  for (size_t i = 0; i < n; i++) {
+    if (i) {
+      memcpy(p, sep, seplen);
+      p += seplen;
+    }
+    memcpy(p, parts[i].ptr, parts[i].len);
+    p += parts[i].len;
+  }
+  *p = '\0';
+  dss_setlen(s, total + DSS_NULLT);
+  return s;
+}
+
+/* Packs. A pack file is a header, an index of the offsets of the strings
+ * and the strings themselves, each behind a regular dss header and aligned
+ * like an allocation. dss_pack_map maps the file and hands out pointers into
+ * the mapping, which are dss strings as they are: their ref_count is
+ * DSS_REF_STATIC and what dss caches about their bytes is computed when the
+ * pack is written, so that nothing ever writes to the mapping. The layout of
+ * the headers is the one of the build that wrote the file, which is checked
+ * when it is mapped. */
+
+#define DSS_PACK_MAGIC "DSSPACK1"
+/* Tells apart files written on a machine of the other byte order */
+#define DSS_PACK_ORDER 0x01020304
+#define DSS_PACK_ALIGN 8
+/* Strings handed to a single writev call, each taking up to 3 iovecs */
+#define DSS_PACK_BATCH (DSS_IOV_BATCH / 3)
+/* Offsets computed before each write of the index */
+#define DSS_PACK_INDEX_BATCH 512
+
+typedef struct {
+  char magic[8];
+  uint32_t order;
+  /* sizeof(dss_hdr8), which tells if the writer had DSS_HASH_CACHE */
+  uint32_t hdr_size;
+  uint64_t count;
+} dss_pack_file;
+
+struct dss_packmap {
+  char *base;
+  size_t size;
+  size_t count;
+  const uint64_t *index;
+};
+
+/* Bytes taken by 's' in a pack, header and padding included */
+static inline size_t dss_pack_record(const dss s) {
+  size_t len = dss_getlen(s);
+  size_t n = dss_hdr_size(dss_req_type(len)) + len;
+  return (n + DSS_PACK_ALIGN - 1) & ~(size_t)(DSS_PACK_ALIGN - 1);
+}
+
+/* Writes into 'mem' the header 's' gets in a pack and returns its size. A
+ * compressed string is stored as it is, with what is cached about its plain
+ * bytes; 0 is returned if they can't be had. */
+static size_t dss_pack_hdr(void *mem, const dss s) {
+  size_t len = dss_getlen(s);
+  dss p = dss_readable(s);
+  if (!p)
+    return 0;
+  size_t n = dss_getlen(p) - DSS_NULLT;
+  int type = dss_req_type(len);
+  dss hs = dss_hdr_init(mem, type, len);
+  /* Not a live string, it is not counted by DSS_STATS */
+  dss_putlen(hs, len);
+  *(uint32_t *)mem = DSS_REF_STATIC;
+  DSS_FLAGS(hs) =
+      DSS_FLAGS(s) & (DSS_FLAG_GROWTH_MASK | DSS_FLAG_COMPRESSED);
+  unsigned char utf8 = DSS_TYPEBYTE(s) & DSS_UTF8_MASK;
+  if (!utf8)
+    utf8 = dss_utf8_check((const unsigned char *)p, n) ? DSS_UTF8_VALID
+                                                        : DSS_UTF8_INVALID;
+  DSS_TYPEBYTE(hs) = (DSS_TYPEBYTE(hs) & ~DSS_UTF8_MASK) | utf8;
+#ifdef DSS_HASH_CACHE
+  uint64_t h = dss_hash_bytes(p, n);
+  memcpy(dss_hashp(hs), &h, sizeof(h));
+  DSS_FLAGS(hs) |= DSS_FLAG_HASHED;
+#endif
+  dss_readable_done(s, p);
+  return dss_hdr_size(type);
+}
+
+/* Writes the 'n' strings of 'arr' to 'fd' as a pack, in one pass and
+ * without seeking, so 'fd' may be a pipe. Returns the number of bytes
+ * written or -1 on error. */
+ssize_t dss_pack(const dss *arr, size_t n, int fd) {
+  static const char zeros[DSS_PACK_ALIGN];
+  struct iovec iov[DSS_IOV_BATCH];
+  dss_pack_file h;
+  ssize_t total = 0, w;
+
+  memcpy(h.magic, DSS_PACK_MAGIC, sizeof(h.magic));
+  h.order = DSS_PACK_ORDER;
+  h.hdr_size = sizeof(dss_hdr8);
+  h.count = n;
+  iov[0].iov_base = &h;
+  iov[0].iov_len = sizeof(h);
+  if ((w = dss_writev_full(fd, iov, 1)) < 0)
+    return -1;
+  total += w;
+
+  /* The index comes first, the offsets being known from the sizes alone */
+  uint64_t offs[DSS_PACK_INDEX_BATCH];
+  uint64_t at = sizeof(h) + n * sizeof(uint64_t);
+  for (size_t i = 0; i < n;) {
+    size_t k = 0;
+    for (; i < n && k < DSS_PACK_INDEX_BATCH; i++, k++) {
+      offs[k] = at + dss_hdr_size(dss_req_type(dss_getlen(arr[i])));
+      at += dss_pack_record(arr[i]);
+    }
+    iov[0].iov_base = offs;
+    iov[0].iov_len = k * sizeof(uint64_t);
+    if ((w = dss_writev_full(fd, iov, 1)) < 0)
+      return -1;
+    total += w;
+  }
+
+  uint64_t hdrs[DSS_PACK_BATCH][(sizeof(dss_hdr64) + 7) / 8];
+  for (size_t i = 0; i < n;) {
+    int cnt = 0;
+    for (size_t k = 0; i < n && k < DSS_PACK_BATCH; i++, k++) {
+      size_t len = dss_getlen(arr[i]);
+      size_t hdrlen = dss_pack_hdr(hdrs[k], arr[i]);
+      if (!hdrlen)
+        return -1;
+      iov[cnt].iov_base = hdrs[k];
+      iov[cnt++].iov_len = hdrlen;
+      /* The null term is part of the string */
+      iov[cnt].iov_base = arr[i];
+      iov[cnt++].iov_len = len;
+      size_t pad = dss_pack_record(arr[i]) - hdrlen - len;
+      if (pad) {
+        iov[cnt].iov_base = (void *)zeros;
+        iov[cnt++].iov_len = pad;
+      }
+    }
+    if ((w = dss_writev_full(fd, iov, cnt)) < 0)
+      return -1;
+    total += w;
+  }
+  return total;
+}
+
+/* Maps a file written by dss_pack read-only. Only the header is read, the
+ * strings are paged in when they are used. Returns NULL with errno set on
+ * error, EINVAL if the file is not a pack of this build. */
+dss_packmap *dss_pack_map(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+  size_t size = (size_t)st.st_size;
+  if (!S_ISREG(st.st_mode) || size < sizeof(dss_pack_file)) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+  char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  int err = errno;
+  close(fd);
+  if (base == MAP_FAILED) {
+    errno = err;
+    return NULL;
+  }
+
+  dss_pack_file h;
+  memcpy(&h, base, sizeof(h));
+  if (memcmp(h.magic, DSS_PACK_MAGIC, sizeof(h.magic)) != 0 ||
+      h.order != DSS_PACK_ORDER || h.hdr_size != sizeof(dss_hdr8) ||
+      h.count > (size - sizeof(h)) / sizeof(uint64_t)) {
+    munmap(base, size);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  dss_packmap *m = dss_malloc(sizeof(dss_packmap));
+  if (!m) {
+    fprintf(stderr, "Not able to allocate memory.");
+    munmap(base, size);
+    errno = ENOMEM;
+    return NULL;
+  }
+  m->base = base;
+  m->size = size;
+  m->count = h.count;
+  m->index = (const uint64_t *)(base + sizeof(h));
+  return m;
+}
+
+size_t dss_pack_count(const dss_packmap *m) { return m->count; }
+
+/* The 'i'th string of the pack. It can be used like any other string, except
+ * that it is read-only: it is changed with the copy-on-write functions,
+ * which copy it out of the mapping. dss_refshare and dss_free do nothing on
+ * it, so it may be stored alongside regular strings, but not used after
+ * dss_pack_unmap. The header of the string is checked against the file,
+ * NULL being returned with errno set to EINVAL if it is corrupt. */
+dss dss_pack_get(const dss_packmap *m, size_t i) {
+  if (i >= m->count) {
+    errno = EINVAL;
+    return NULL;
+  }
+  size_t first = sizeof(dss_pack_file) + m->count * sizeof(uint64_t);
+  uint64_t off = m->index[i];
+  if (off <= first || off >= m->size)
+    goto corrupt;
+  dss s = m->base + off;
+  size_t hdrlen = dss_hdr_size(DSS_TYPE(s));
+  if (off - first < hdrlen || (off - hdrlen) % DSS_PACK_ALIGN)
+    goto corrupt;
+  size_t len = dss_getlen(s);
+  if (len < DSS_NULLT || len > m->size - off || dss_getcap(s) != len ||
+      s[len - 1] != '\0' || *dss_refp(s) != DSS_REF_STATIC ||
+      (DSS_FLAGS(s) & (DSS_STORAGE_FLAGS | DSS_FLAG_ATOMIC)))
+    goto corrupt;
+  return s;
+
+corrupt:
+  errno = EINVAL;
+  return NULL;
+}
+
+/* Unmaps the pack. Its strings must not be used any more, copies made of
+ * them are not affected. */
+void dss_pack_unmap(dss_packmap *m) {
+  if (!m)
+    return;
+  munmap(m->base, m->size);
+  dss_dealloc(m);
 }
@@ -1,28 +1,457 @@
 #ifndef __dss_h__
 #define __dss_h__
 
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /* Extra byte allocated for a null terminator (for C-string compatibility) */
 #define DSS_NULLT 1
 
+/* Growth policy applied by strings that don't override it. Doubling is what
+ * dss has always done. */
+#ifndef DSS_DEFAULT_GROWTH
+#define DSS_DEFAULT_GROWTH DSS_GROWTH_DOUBLE
+#endif
+
+/* Buffer size where DSS_GROWTH_CAPPED stops doubling, and the fixed step it
+ * grows by afterwards. Both can be changed at runtime with
+ * dss_set_growth_step. */
+#ifndef DSS_GROWTH_THRESHOLD
+#define DSS_GROWTH_THRESHOLD (1024 * 1024)
+#endif
+#ifndef DSS_GROWTH_STEP
+#define DSS_GROWTH_STEP (1024 * 1024)
+#endif
+
+/* Define DSS_ATOMIC_REFCOUNT when building dss.c to make dss_refshare and
+ * dss_free thread safe for every string. Without it, single strings can
+ * opt in with dss_set_atomic_refcount. */
+
+/* Define DSS_HASH_CACHE to keep the result of dss_hash in the header. It
+ * costs 8 more bytes per string. As it changes the header layout, it must be
+ * defined for every file that includes dss.h, not only dss.c. */
+
+/* Default size of the blocks a dss_arena allocates strings from */
+#ifndef DSS_ARENA_BLOCK_SIZE
+#define DSS_ARENA_BLOCK_SIZE (64 * 1024)
+#endif
+
+/* Allocation size from which a string gets its own anonymous mapping. Can
+ * be changed at runtime with dss_set_mmap_threshold. */
+#ifndef DSS_MMAP_THRESHOLD
+#define DSS_MMAP_THRESHOLD (64 * 1024 * 1024)
+#endif
+
+/* Number of freed small blocks every thread keeps for reuse per size
+ * class, 0 meaning no cache. Can be changed at runtime with
+ * dss_set_thread_cache. */
+#ifndef DSS_THREAD_CACHE
+#define DSS_THREAD_CACHE 0
+#endif
+
+/* Percentage of the capacity that must be unused before dss_trim and
+ * dss_shrink give memory back, see dss_set_shrink_slack. */
+#ifndef DSS_SHRINK_SLACK
+#define DSS_SHRINK_SLACK 50
+#endif
+
+/* Define DSS_STATS when building dss.c to count allocations, copies and
+ * live bytes per thread, see dss_stats_get. Without it nothing is counted
+ * and the counting code is not compiled in. Define DSS_USDT as well, or
+ * alone, to put USDT probes of provider "dss" at the same places when
+ * <sys/sdt.h> is available: alloc, free, resize, dup and cow_copy. */
+
+/* Number of buckets of the realloc histogram of dss_stats */
+#define DSS_STATS_BUCKETS 40
+
+/* Default size of the chunks of a dss_rope */
+#ifndef DSS_ROPE_CHUNK_SIZE
+#define DSS_ROPE_CHUNK_SIZE (1024 * 1024)
+#endif
+
 typedef char *dss;
 
+/* Header classes. They are published so that the accessors below can be
+ * inlined, but only dss.c writes to them. Every class stores the same
+ * metadata, only the width of size and len changes so that short strings
+ * don't pay for 64-bit fields.
+ * The class is chosen from the capacity of buf when the string is allocated
+ * and recorded in the low bits of the type byte which always sits right
+ * before buf. dss.c keeps the UTF-8 state of the string in its other bits.
+ *
+ * ref_count is the first member of every class so it stays naturally
+ * aligned at the start of the allocation. When built with DSS_HASH_CACHE,
+ * every class carries a cached hash right after it.
+ */
+#ifdef DSS_HASH_CACHE
+/* Cached hash of the bytes, valid while DSS_FLAG_HASHED is set */
+#define DSS_HDR_HASH uint64_t hash;
+#else
+#define DSS_HDR_HASH
+#endif
+
+typedef struct __attribute__((__packed__)) {
+  /*Tracks the number of references created. */
+  uint32_t ref_count;
+  DSS_HDR_HASH
+  /* Number of bytes occupied in buf. len is total bytes in buf + null term.
+   * That's why creating empty dss string using dss_empty should result in
+   * len=1.*/
+  uint8_t len;
+  /* Capacity of buf in bytes, null term included. The header is not
+   * counted. */
+  uint8_t size;
+  /* Per-string attributes. Lower 3 bits hold the growth policy, 0 meaning
+   * the string follows the global default. */
+  uint8_t flags;
+  /* Header class, one of DSS_TYPE_* */
+  unsigned char type;
+  char buf[];
+} dss_hdr8;
+
+typedef struct __attribute__((__packed__)) {
+  uint32_t ref_count;
+  DSS_HDR_HASH
+  uint16_t len;
+  uint16_t size;
+  uint8_t flags;
+  unsigned char type;
+  char buf[];
+} dss_hdr16;
+
+typedef struct __attribute__((__packed__)) {
+  uint32_t ref_count;
+  DSS_HDR_HASH
+  uint32_t len;
+  uint32_t size;
+  uint8_t flags;
+  unsigned char type;
+  char buf[];
+} dss_hdr32;
+
+typedef struct __attribute__((__packed__)) {
+  uint32_t ref_count;
+  DSS_HDR_HASH
+  uint64_t len;
+  uint64_t size;
+  uint8_t flags;
+  unsigned char type;
+  char buf[];
+} dss_hdr64;
+
+#define DSS_TYPE_8 0
+#define DSS_TYPE_16 1
+#define DSS_TYPE_32 2
+#define DSS_TYPE_64 3
+#define DSS_TYPE_MASK 0x03
+
+#define DSS_HDR(T, s) ((dss_hdr##T *)((char *)(s) - sizeof(dss_hdr##T)))
+#define DSS_TYPE(s) (((unsigned char *)(s))[-1] & DSS_TYPE_MASK)
+static inline size_t dss_hdr_size(int type) {
+  switch (type) {
+  case DSS_TYPE_8:
+    return sizeof(dss_hdr8);
+  case DSS_TYPE_16:
+    return sizeof(dss_hdr16);
+  case DSS_TYPE_32:
+    return sizeof(dss_hdr32);
+  }
+  return sizeof(dss_hdr64);
+}
+
+/* Start of the allocation the string lives in */
+static inline void *dss_hdr_start(const dss s) {
+  return (char *)s - dss_hdr_size(DSS_TYPE(s));
+}
+
+static inline size_t dss_getlen(const dss s) {
+  switch (DSS_TYPE(s)) {
+  case DSS_TYPE_8:
+    return DSS_HDR(8, s)->len;
+  case DSS_TYPE_16:
+    return DSS_HDR(16, s)->len;
+  case DSS_TYPE_32:
+    return DSS_HDR(32, s)->len;
+  }
+  return DSS_HDR(64, s)->len;
+}
+
+static inline size_t dss_getcap(const dss s) {
+  switch (DSS_TYPE(s)) {
+  case DSS_TYPE_8:
+    return DSS_HDR(8, s)->size;
+  case DSS_TYPE_16:
+    return DSS_HDR(16, s)->size;
+  case DSS_TYPE_32:
+    return DSS_HDR(32, s)->size;
+  }
+  return DSS_HDR(64, s)->size;
+}
+
+/* Length of the string in bytes, null term included */
+static inline size_t dss_len(const dss s) { return dss_getlen(s); }
+
+/* Number of bytes of the string, without the null term. For a compressed
+ * string these are the compressed bytes, dss_raw_len tells the plain
+ * length. */
+static inline size_t dss_strlen(const dss s) {
+  return dss_getlen(s) - DSS_NULLT;
+}
+
+/* Capacity of the buffer, null term included */
+static inline size_t dss_cap(const dss s) { return dss_getcap(s); }
+
+/* Number of bytes that can be appended without reallocating */
+static inline size_t dss_avail(const dss s) {
+  return dss_getcap(s) - dss_getlen(s);
+}
+
+/* ref_count of strings that are never freed, such as the strings of a
+ * dss_packmap. dss_refshare and dss_free leave it as it is, and the
+ * copy-on-write functions always copy them. */
+#define DSS_REF_STATIC UINT32_MAX
+
+/* Number of references to the string. ref_count leads every header
+ * class. */
+static inline uint32_t dss_refcount(const dss s) {
+  return __atomic_load_n((uint32_t *)dss_hdr_start(s), __ATOMIC_RELAXED);
+}
+
+typedef struct dss_arena dss_arena;
+typedef struct dss_rope dss_rope;
+typedef struct dss_intern_table dss_intern_table;
+typedef struct dss_mpsc dss_mpsc;
+typedef struct dss_packmap dss_packmap;
+
+/* View of 'len' bytes at 'ptr' inside the dss string 'parent', on which the
+ * slice holds a reference. The bytes are not null terminated. */
+typedef struct {
+  const char *ptr;
+  size_t len;
+  dss parent;
+} dss_slice;
+
+/* Appends bytes into a caller supplied buffer before building a dss string
+ * out of them, see dss_builder_init. 'len' bytes are in 'buf', which is not
+ * null terminated. */
+typedef struct {
+  char *buf;
+  size_t len;
+  size_t cap;
+  /* Buffer given to dss_builder_init */
+  char *stack;
+  size_t stack_size;
+} dss_builder;
+
+/* Called with the plain and compressed sizes of a string every time one is
+ * compressed, 'decompressed' being 0, or decompressed, see
+ * dss_set_compress_hook */
+typedef void (*dss_compress_hook)(size_t raw, size_t packed,
+                                  int decompressed);
+
+/* Counts of a DSS_STATS build, see dss_stats_get. Arena strings are left
+ * out. */
+typedef struct {
+  /* Buffers allocated, including the ones a resize moves a string to */
+  uint64_t allocs;
+  /* Buffers given back */
+  uint64_t frees;
+  /* Buffers resized in place or moved to a new one to grow or shrink */
+  uint64_t reallocs;
+  /* Reallocations made to give memory back, by dss_trim and dss_shrink */
+  uint64_t shrinks;
+  /* Shared strings copied by the copy-on-write functions */
+  uint64_t cow_copies;
+  /* Strings copied by dss_dup */
+  uint64_t dups;
+  /* Bytes copied by the two above and by resizes that move a string */
+  uint64_t copied_bytes;
+  /* Sum of dss_len and of dss_cap of the strings alive, not reset by
+   * dss_stats_reset */
+  uint64_t live_len;
+  uint64_t live_cap;
+  /* Reallocations by new capacity, bucket i counting those from 2^i up to
+   * 2^(i+1) bytes and the last one everything above */
+  uint64_t realloc_hist[DSS_STATS_BUCKETS];
+} dss_stats;
+
+/* Allocator hooks, see dss_set_allocator */
+typedef struct {
+  void *(*malloc_fn)(size_t);
+  void *(*realloc_fn)(void *, size_t);
+  void (*free_fn)(void *);
+  /* Real size of a block returned by malloc_fn/realloc_fn, such as
+   * malloc_usable_size. Optional. */
+  size_t (*usable_size_fn)(void *);
+} dss_allocator;
+
+/* Strategies used by the internal expand routine to decide how much extra
+ * room to reserve when a string runs out of capacity. */
+typedef enum {
+  /* Follow the global default set with dss_set_default_growth */
+  DSS_GROWTH_DEFAULT = 0,
+  /* Double the capacity */
+  DSS_GROWTH_DOUBLE,
+  /* Grow the capacity by half of itself */
+  DSS_GROWTH_ONE_HALF,
+  /* Double up to a threshold, then grow by a fixed step */
+  DSS_GROWTH_CAPPED,
+  /* Allocate exactly what is needed */
+  DSS_GROWTH_EXACT,
+} dss_growth_policy;
+
 dss dss_new(const char *);
 dss dss_newb(const void *, size_t);
 dss dss_concat(dss, const char *);
 dss dss_concatb(dss, const void *, size_t);
+dss dss_concatv(dss, const struct iovec *, int);
+dss dss_concat_many(dss, ...);
 dss dss_concatcow(dss, const char *);
 dss dss_concatcowb(dss, const char *, size_t);
-size_t dss_len(const dss);
+dss dss_concatvcow(dss, const struct iovec *, int);
+dss dss_unshare_reserve(dss, size_t);
 dss dss_dup(const dss);
 dss dss_grow(dss, size_t);
+dss dss_growcow(dss, size_t);
 dss dss_empty(void);
 void dss_free(dss);
 
 dss dss_refshare(dss);
 
 dss dss_catprintf(dss, dss (*)(dss, const char *), const char *, ...);
+dss dss_catvprintf(dss, const char *, va_list);
+dss dss_catint(dss, long long);
+dss dss_catuint(dss, unsigned long long);
+dss dss_catdouble(dss, double, int);
+dss dss_catfmt(dss, const char *, ...);
 dss dss_trim(dss, int, int);
+dss dss_trimcow(dss, int, int);
+
+dss dss_reserve(dss, size_t);
+dss dss_makeroom(dss, size_t);
+void dss_incrlen(dss, ssize_t);
+dss dss_shrink(dss);
+dss dss_shrink_to_fit(dss);
+void dss_set_shrink_slack(unsigned);
+
+void dss_set_default_growth(dss_growth_policy);
+dss_growth_policy dss_get_default_growth(void);
+void dss_set_growth_step(size_t, size_t);
+void dss_set_growth_policy(dss, dss_growth_policy);
+dss_growth_policy dss_get_growth_policy(const dss);
+
+void dss_set_atomic_refcount(dss, int);
+
+void dss_set_allocator(const dss_allocator *);
+void dss_set_mmap_threshold(size_t);
+void dss_set_thread_cache(size_t);
+void dss_thread_cache_flush(void);
+
+int dss_stats_get(dss_stats *);
+void dss_stats_reset(void);
+
+dss_arena *dss_arena_new(size_t);
+void dss_arena_reset(dss_arena *);
+void dss_arena_destroy(dss_arena *);
+dss dss_new_arena(dss_arena *, const char *);
+dss dss_newb_arena(dss_arena *, const void *, size_t);
+dss dss_empty_arena(dss_arena *);
+dss dss_dup_arena(dss_arena *, const dss);
+dss dss_concat_arena(dss_arena *, dss, const char *);
+dss dss_concatb_arena(dss_arena *, dss, const void *, size_t);
+
+void dss_builder_init(dss_builder *, void *, size_t);
+int dss_builder_concat(dss_builder *, const char *);
+int dss_builder_concatb(dss_builder *, const void *, size_t);
+int dss_builder_catvprintf(dss_builder *, const char *, va_list);
+int dss_builder_catprintf(dss_builder *, const char *, ...);
+int dss_builder_catint(dss_builder *, long long);
+int dss_builder_catuint(dss_builder *, unsigned long long);
+int dss_builder_catdouble(dss_builder *, double, int);
+void dss_builder_reset(dss_builder *);
+dss dss_builder_finish(dss_builder *);
+
+dss_rope *dss_rope_new(size_t);
+void dss_rope_free(dss_rope *);
+int dss_rope_concat(dss_rope *, const char *);
+int dss_rope_concatb(dss_rope *, const void *, size_t);
+size_t dss_rope_len(const dss_rope *);
+size_t dss_rope_chunks(const dss_rope *);
+int dss_rope_iov(const dss_rope *, size_t, struct iovec *, int);
+ssize_t dss_rope_writev(const dss_rope *, int);
+dss dss_rope_flatten(dss_rope *);
+
+ssize_t dss_find(const dss, const void *, size_t);
+ssize_t dss_rfind(const dss, const void *, size_t);
+size_t dss_find_all(const dss, const void *, size_t, size_t *, size_t);
+size_t dss_count(const dss, const void *, size_t);
+
+dss dss_cathex(dss, const void *, size_t);
+dss dss_cathex_decode(dss, const void *, size_t);
+dss dss_catbase64(dss, const void *, size_t);
+dss dss_catbase64_decode(dss, const void *, size_t);
+
+int dss_is_utf8(const dss);
+
+dss dss_compress(dss);
+dss dss_decompress(dss);
+int dss_is_compressed(const dss);
+size_t dss_raw_len(const dss);
+void dss_set_compress_hook(dss_compress_hook);
+
+uint64_t dss_hash(const dss);
+void dss_touch(dss);
+int dss_eq(const dss, const dss);
+int dss_cmp(const dss, const dss);
+
+dss_intern_table *dss_intern_new(size_t);
+dss dss_intern(dss_intern_table *, const void *, size_t);
+size_t dss_intern_sweep(dss_intern_table *);
+void dss_intern_free(dss_intern_table *);
+
+dss_slice dss_slice_new(dss, size_t, size_t);
+dss_slice dss_slice_sub(dss_slice, size_t, size_t);
+void dss_slice_release(dss_slice *);
+dss dss_slice_materialize(dss_slice);
+int dss_slice_eq(dss_slice, dss_slice);
+int dss_slice_cmp(dss_slice, dss_slice);
+ssize_t dss_slice_find(dss_slice, const void *, size_t);
+uint64_t dss_slice_hash(dss_slice);
+
+dss_slice *dss_split(dss, const void *, size_t, size_t *);
+dss_slice *dss_splitlines(dss, size_t *);
+void dss_slices_free(dss_slice *, size_t);
+dss dss_join(const dss *, size_t, const char *);
+dss dss_join_slices(const dss_slice *, size_t, const char *);
+
+dss dss_read_fd(dss, int, size_t);
+dss dss_readfile(const char *);
+ssize_t dss_writev_all(int, dss *, size_t);
+
+dss_mpsc *dss_mpsc_new(size_t, size_t);
+void dss_mpsc_free(dss_mpsc *);
+int dss_mpsc_append(dss_mpsc *, const void *, size_t);
+int dss_mpsc_flush(dss_mpsc *);
+dss dss_mpsc_pop(dss_mpsc *);
+int dss_mpsc_iov(dss_mpsc *, struct iovec *, int);
+void dss_mpsc_consume(dss_mpsc *, int);
+ssize_t dss_mpsc_writev(dss_mpsc *, int);
+
+ssize_t dss_pack(const dss *, size_t, int);
+dss_packmap *dss_pack_map(const char *);
+size_t dss_pack_count(const dss_packmap *);
+dss dss_pack_get(const dss_packmap *, size_t);
+void dss_pack_unmap(dss_packmap *);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
@@ -0,0 +1,220 @@
+// C++ wrapper of dss. dsspp::string owns one reference to a dss string:
+// copying it takes another reference with dss_refshare instead of copying
+// the bytes, moving it steals the pointer, and the destructor drops the
+// reference with dss_free. Mutators copy a shared string first, so copies
+// behave as values.
+//
+// The namespace can't be called dss, which is the name of the C type.
+// Header-only, but dss.c still has to be linked. Requires C++17.
+#ifndef __dss_hpp__
+#define __dss_hpp__
+
+#if __cplusplus < 201703L
+#error "dss.hpp requires C++17"
+#endif
+
+#include "dss.h"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace dsspp {
+
+class string {
+public:
+  // A default constructed string holds no dss at all and allocates on the
+  // first append. It can be constant initialized.
+  constexpr string() noexcept : s_(nullptr) {}
+
+  string(const char *t) : string(std::string_view(t)) {}
+
+  string(std::string_view t) : s_(::dss_newb(t.data(), t.size())) {
+    if (!s_)
+      throw std::bad_alloc();
+  }
+
+  string(const string &o) noexcept
+      : s_(o.s_ ? ::dss_refshare(o.s_) : nullptr) {}
+
+  string(string &&o) noexcept : s_(o.s_) { o.s_ = nullptr; }
+
+  ~string() { ::dss_free(s_); }
+
+  string &operator=(const string &o) noexcept {
+    if (s_ != o.s_) {
+      ::dss_free(s_);
+      s_ = o.s_ ? ::dss_refshare(o.s_) : nullptr;
+    }
+    return *this;
+  }
+
+  string &operator=(string &&o) noexcept {
+    if (this != &o) {
+      ::dss_free(s_);
+      s_ = o.s_;
+      o.s_ = nullptr;
+    }
+    return *this;
+  }
+
+  // Takes over a reference the caller owns, without taking another one. A
+  // compressed string is decompressed first, as the wrapper reads the bytes
+  // directly; on failure the reference is dropped and std::bad_alloc thrown.
+  static string adopt(::dss s) {
+    string r;
+    if (s && ::dss_is_compressed(s)) {
+      ::dss p = ::dss_decompress(s);
+      if (!p) {
+        ::dss_free(s);
+        throw std::bad_alloc();
+      }
+      s = p;
+    }
+    r.s_ = s;
+    return r;
+  }
+
+  // Gives the reference back to the caller, who has to dss_free it. NULL
+  // when nothing was ever appended to a default constructed string.
+  ::dss release() noexcept {
+    ::dss s = s_;
+    s_ = nullptr;
+    return s;
+  }
+
+  // The dss string itself, to be passed to read-only C functions.
+  ::dss get() const noexcept { return s_; }
+
+  const char *data() const noexcept { return s_ ? s_ : ""; }
+  const char *c_str() const noexcept { return data(); }
+  std::size_t size() const noexcept { return s_ ? ::dss_strlen(s_) : 0; }
+  std::size_t length() const noexcept { return size(); }
+  bool empty() const noexcept { return size() == 0; }
+
+  // Bytes that fit without reallocating, null term excluded
+  std::size_t capacity() const noexcept {
+    return s_ ? ::dss_cap(s_) - DSS_NULLT : 0;
+  }
+
+  // Number of strings sharing the buffer
+  std::uint32_t use_count() const noexcept {
+    return s_ ? ::dss_refcount(s_) : 0;
+  }
+
+  char operator[](std::size_t i) const noexcept { return data()[i]; }
+  const char *begin() const noexcept { return data(); }
+  const char *end() const noexcept { return data() + size(); }
+
+  operator std::string_view() const noexcept { return {data(), size()}; }
+
+  std::string str() const { return std::string(data(), size()); }
+
+  // Makes room for 'n' bytes in total. A shared string is copied into a
+  // buffer of that size, an unshared one is resized in place.
+  void reserve(std::size_t n) {
+    std::size_t len = size();
+    std::size_t extra = n > len ? n - len : 0;
+    if (!s_)
+      s_ = check(::dss_empty());
+    if (::dss_refcount(s_) > 1)
+      s_ = check(::dss_unshare_reserve(s_, extra));
+    else
+      s_ = check(::dss_reserve(s_, extra));
+  }
+
+  string &append(const char *t, std::size_t len) {
+    if (!s_) {
+      s_ = check(::dss_newb(t, len));
+      return *this;
+    }
+    // The bytes may come from this very buffer, which is about to move
+    if (t >= s_ && t < s_ + size()) {
+      std::size_t off = t - s_;
+      s_ = check(::dss_unshare_reserve(s_, len));
+      t = s_ + off;
+    }
+    // Appends in place, or copies once if the buffer is shared. On failure
+    // the string is left as it was.
+    s_ = check(::dss_concatcowb(s_, t, len));
+    return *this;
+  }
+
+  string &operator+=(std::string_view t) {
+    return append(t.data(), t.size());
+  }
+  string &operator+=(const char *t) { return *this += std::string_view(t); }
+  string &operator+=(const string &t) { return *this += std::string_view(t); }
+  string &operator+=(char c) { return append(&c, 1); }
+
+  // Drops the reference, keeping no buffer
+  void clear() noexcept { *this = string(); }
+
+  void swap(string &o) noexcept { std::swap(s_, o.s_); }
+
+private:
+  ::dss s_;
+
+  static ::dss check(::dss s) {
+    if (!s)
+      throw std::bad_alloc();
+    return s;
+  }
+};
+
+inline string operator+(string a, std::string_view b) {
+  a += b;
+  return a;
+}
+
+inline void swap(string &a, string &b) noexcept { a.swap(b); }
+
+// Comparisons go through std::string_view. There is one overload per
+// kind of operand, none of them allocating a temporary string.
+#define DSSPP_COMPARE(op)                                                      \
+  inline bool operator op(const string &a, const string &b) noexcept {         \
+    return std::string_view(a) op std::string_view(b);                         \
+  }                                                                            \
+  inline bool operator op(const string &a, std::string_view b) noexcept {      \
+    return std::string_view(a) op b;                                           \
+  }                                                                            \
+  inline bool operator op(std::string_view a, const string &b) noexcept {      \
+    return a op std::string_view(b);                                           \
+  }                                                                            \
+  inline bool operator op(const string &a, const char *b) noexcept {           \
+    return std::string_view(a) op std::string_view(b);                         \
+  }                                                                            \
+  inline bool operator op(const char *a, const string &b) noexcept {           \
+    return std::string_view(a) op std::string_view(b);                         \
+  }
+DSSPP_COMPARE(==)
+DSSPP_COMPARE(!=)
+DSSPP_COMPARE(<)
+DSSPP_COMPARE(<=)
+DSSPP_COMPARE(>)
+DSSPP_COMPARE(>=)
+#undef DSSPP_COMPARE
+
+namespace literals {
+// "text"_dss builds a string with the length known at compile time, so
+// embedded null bytes are kept and nothing is scanned for the length
+inline string operator""_dss(const char *t, std::size_t len) {
+  return string(std::string_view(t, len));
+}
+} // namespace literals
+
+} // namespace dsspp
+
+// Same hash as the std::string_view of the bytes
+namespace std {
+template <> struct hash<dsspp::string> {
+  size_t operator()(const dsspp::string &s) const noexcept {
+    return hash<string_view>()(s);
+  }
+};
+} // namespace std
+
+#endif